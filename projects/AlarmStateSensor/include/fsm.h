@@ -0,0 +1,104 @@
+//
+// Table driven finite state machines, checked at compile time.
+//
+// A machine is a constant table: for each of S states, the state each
+// of I inputs goes to, and the output of the state, one of O values.
+// Declare the table constexpr and the checks below can be used in
+// static_assert()s, so a mistake in the table fails the build instead
+// of quietly decoding the wrong thing:
+//
+//	constexpr fsm<3, 2, 2> m = {{{0, 1}, {2, 1}, {0, 2}}, {0, 1, 1}};
+//	static_assert(fsm_valid(m, 0), "m is broken");
+//
+// One input is usually a timeout, fed in by the caller when the machine
+// has been in a state too long; to the table it is just another input.
+//
+// Only needs the compiler, so it builds the same for the ESP8266 and
+// natively.  The checks are C++11 constexpr, so one return statement
+// each, and recursion for loops.  At most 32 states.
+//
+
+#ifndef FSM_H
+#define FSM_H
+
+#include <stdint.h>
+
+template <unsigned char S, unsigned char I, unsigned char O>
+struct fsm {
+	unsigned char next[S][I];
+	unsigned char output[S];
+
+	static const unsigned char states = S;
+	static const unsigned char inputs = I;
+	static const unsigned char outputs = O;
+
+	unsigned char step(unsigned char state, unsigned char input) const {
+		return next[state][input];
+	}
+};
+
+//
+// Every next state and every output is in range.
+//
+template <unsigned char S, unsigned char I, unsigned char O>
+constexpr bool fsm_in_range(const fsm<S, I, O>& m, unsigned s = 0, unsigned i = 0)
+{
+	return s >= S? true:
+	    i >= I? m.output[s] < O && fsm_in_range(m, s + 1, 0):
+	    m.next[s][i] < S && fsm_in_range(m, s, i + 1);
+}
+
+//
+// Reachability.  A set of states is a bit mask.
+//
+
+// The states one input takes the states in mask to, from state s up
+template <unsigned char S, unsigned char I, unsigned char O>
+constexpr uint32_t fsm_successors(const fsm<S, I, O>& m, uint32_t mask, unsigned s = 0, unsigned i = 0)
+{
+	return s >= S? 0:
+	    i >= I? fsm_successors(m, mask, s + 1, 0):
+	    ((mask >> s & 1)? (uint32_t)1 << m.next[s][i]: 0) | fsm_successors(m, mask, s, i + 1);
+}
+
+// All the states reachable from those in mask
+template <unsigned char S, unsigned char I, unsigned char O>
+constexpr uint32_t fsm_closure(const fsm<S, I, O>& m, uint32_t mask)
+{
+	return (mask | fsm_successors(m, mask)) == mask? mask:
+	    fsm_closure(m, mask | fsm_successors(m, mask));
+}
+
+template <unsigned char S>
+constexpr uint32_t fsm_all()
+{
+	return S >= 32? ~(uint32_t)0: ((uint32_t)1 << S) - 1;
+}
+
+// Every state can be reached from start
+template <unsigned char S, unsigned char I, unsigned char O>
+constexpr bool fsm_reachable(const fsm<S, I, O>& m, unsigned char start)
+{
+	return fsm_closure(m, (uint32_t)1 << start) == fsm_all<S>();
+}
+
+// start can be reached again from every state, from state s up
+template <unsigned char S, unsigned char I, unsigned char O>
+constexpr bool fsm_returns(const fsm<S, I, O>& m, unsigned char start, unsigned s = 0)
+{
+	return s >= S? true:
+	    (fsm_closure(m, (uint32_t)1 << s) >> start & 1) && fsm_returns(m, start, s + 1);
+}
+
+//
+// All of the above: a table that can't go out of range, with no state
+// that can't happen and none that it can get stuck in.
+//
+template <unsigned char S, unsigned char I, unsigned char O>
+constexpr bool fsm_valid(const fsm<S, I, O>& m, unsigned char start)
+{
+	return S <= 32 && start < S && fsm_in_range(m) &&
+	    fsm_reachable(m, start) && fsm_returns(m, start);
+}
+
+#endif
@@ -0,0 +1,126 @@
+//
+// The pin 18 decoder.
+//
+// While the alarm is armed (pin 17 on), the panel tells us more on pin 18,
+// by holding it steady or pulsing it short or for two seconds at a time.
+// The decoder is an fsm<> (see fsm.h) run on each edge of pin 18, at the
+// time of the edge, and on a timeout when a state has lasted p18_timeout
+// ms.  Its output is the cooked state.
+//
+// Only needs the compiler, like fsm.h, so the native tests in
+// test/test_p18 run it exactly as the firmware does.
+//
+
+#ifndef P18_H
+#define P18_H
+
+#include "fsm.h"
+
+// Possible states of the P18 decoder
+#define	S_idle_low	0
+#define	S_h1		1
+#define	S_h2		2
+#define	S_h3		3
+#define	S_h4		4
+#define	S_two_sec	5
+#define	S_high		6
+#define	S_l1		7
+#define	S_l2		8
+#define	S_l3		9
+#define	N_STATES	10
+
+// Inputs to the P18 decoder
+#define	I_low		0
+#define	I_high		1
+#define	I_timeout	2
+#define	N_INPUTS	3
+
+// Possible cooked states
+#define	P_Disarmed	0
+#define	P_Off		1
+#define	P_High		2
+#define	P_Pulse		3
+#define	P_Two_Sec	4
+#define	N_COOKED	5
+
+/*
+ * P18 decoder state machine.  next[current_state][i] is the next state,
+ * where i is I_low or I_high when p18 is 0 or 1, I_timeout when a
+ * timeout happens.  output[current_state] is the cooked state.
+ */
+constexpr fsm<N_STATES, N_INPUTS, N_COOKED> p18_fsm = {
+	{
+		{S_idle_low, S_h1, S_idle_low},		// S_idle_low
+		{S_h2, S_h1, S_h4},			// S_h1
+		{S_h2, S_h3, S_idle_low},		// S_h2
+		{S_h2, S_h3, S_h4},			// S_h3
+		{S_two_sec, S_h4, S_high},		// S_h4
+		{S_two_sec, S_h1, S_two_sec},		// S_two_sec
+		{S_l1, S_high, S_high},			// S_high
+		{S_l1, S_l2, S_idle_low},		// S_l1
+		{S_h2, S_l2, S_l3},			// S_l2
+		{S_two_sec, S_l3, S_high},		// S_l3
+	}, {
+		P_Off,					// S_idle_low
+		P_Two_Sec,				// S_h1
+		P_Pulse,				// S_h2
+		P_Pulse,				// S_h3
+		P_Two_Sec,				// S_h4
+		P_Two_Sec,				// S_two_sec
+		P_High,					// S_high
+		P_High,					// S_l1
+		P_High,					// S_l2
+		P_High,					// S_l3
+	}
+};
+
+static_assert(fsm_valid(p18_fsm, S_idle_low), "P18 decoder table is broken");
+
+//
+// P18 state machine stuff
+//
+// The machine only moves on an edge or a timeout, so it is run on the
+// edges the interrupt caught, at the times it caught them, and timeouts
+// are counted from the time the state was entered.
+//
+static unsigned char p18_current_state;
+static unsigned long p18_state_enter_time;	// millis() of the edge or timeout that got us here
+static bool p18_timing;			// false for no pending timeout
+static const long p18_timeout = 1500;	// timeouts occur after 1.5 seconds
+
+static void p18_reset()
+{
+	p18_current_state = S_idle_low;
+	p18_timing = false;
+}
+
+// Move to state p at time t
+static void p18_enter(unsigned char p, unsigned long t)
+{
+	if (p != p18_current_state) {
+		p18_state_enter_time = t;
+		p18_timing = true;
+	}
+	p18_current_state = p;
+}
+
+// Take any timeouts due by time t
+static void p18_expire(unsigned long t)
+{
+	unsigned long due;
+
+	while (p18_timing && (long)(t - p18_state_enter_time) >= p18_timeout) {
+		due = p18_state_enter_time + p18_timeout;
+		p18_timing = false;
+		p18_enter(p18_fsm.step(p18_current_state, I_timeout), due);
+	}
+}
+
+// Pin 18 is p18 from time t
+static void p18_machine(unsigned char p18, unsigned long t)
+{
+	p18_expire(t);
+	p18_enter(p18_fsm.step(p18_current_state, p18? I_high: I_low), t);
+}
+
+#endif
@@ -24,11 +24,22 @@
 //  and moved from Arduino IDE to platformio.
 //  Also, stopped (inappropriately) ising a range node.
 //
+// Version 0.6 catches every edge on pins 17 and 18 in an interrupt,
+//  with its time, and decodes them in loop() whether or not we're
+//  connected.  Pin 18 timeouts are measured from the edge times, so
+//  loop() jitter doesn't matter, and the state is right the moment
+//  we reconnect.
+//
+// Version 0.7 keeps the pin 18 decoder in an fsm<> table (include/fsm.h),
+//  which the compiler checks.  The decoder is in include/p18.h, and
+//  test/test_p18 checks it against the old poller natively.
+//
 
 #include <Homie.h>
+#include "p18.h"
 
 #define FIRMWARE_NAME     "alarm-state"
-#define FIRMWARE_VERSION  "0.5.2"
+#define FIRMWARE_VERSION  "0.7.0"
 
 // Note: all of these LEDs are on when LOW, off when HIGH
 static const uint8_t PIN_LED0 = D4; // the WeMos blue LED
@@ -54,31 +65,12 @@ const unsigned char blink_start = 11;  // set to 2*n+1 for n blinks
 bool blinking;
 unsigned char alarm_status;
 unsigned char cooked_alarm_status;
+unsigned long edge_lost_status;
 
 /*
  * Stuff for handling decode the alarm state
  */
 
-// Possible states of the P18 decoder
-#define	S_idle_low	0
-#define	S_h1		1
-#define	S_h2		2
-#define	S_h3		3
-#define	S_h4		4
-#define	S_two_sec	5
-#define	S_high		6
-#define	S_l1		7
-#define	S_l2		8
-#define	S_l3		9
-#define	N_STATES	10
-
-// Possible cooked states
-#define	P_Disarmed	0
-#define	P_Off		1
-#define	P_High		2
-#define	P_Pulse		3
-#define	P_Two_Sec	4
-
 // If P17 is on, these are the alarm state names
 const char *cooked_alarm_states[] = {
 	"disarmed",
@@ -88,38 +80,8 @@ const char *cooked_alarm_states[] = {
 	"armed-away",
 };
 
-/*
- * P18 decoder state machine.  Input is [current_state][i] where
- 	i = 0 when p18 is 0
-	i = 1 when p18 is 1
-	i = 2 when timeout happens
- */
-const unsigned char p18_state_table[N_STATES][3] = {
-	{S_idle_low, S_h1, S_idle_low},		// S_idle_low
-	{S_h2, S_h1, S_h4},			// S_h1
-	{S_h2, S_h3, S_idle_low},		// S_h2
-	{S_h2, S_h3, S_h4},			// S_h3
-	{S_two_sec, S_h4, S_high},		// S_h4
-	{S_two_sec, S_h1, S_two_sec},		// S_two_sec
-	{S_l1, S_high, S_high},			// S_high
-	{S_l1, S_l2, S_idle_low},		// S_l1
-	{S_h2, S_l2, S_l3},			// S_l2
-	{S_two_sec, S_l3, S_high},		// S_l3
-};
-
-// P18 state output values
-const unsigned char p18_state_output[N_STATES] = {
-	P_Off,
-	P_Two_Sec,
-	P_Pulse,
-	P_Pulse,
-	P_Two_Sec,
-	P_Two_Sec,
-	P_High,
-	P_High,
-	P_High,
-	P_High,
-};
+static_assert(sizeof cooked_alarm_states / sizeof cooked_alarm_states[0] == N_COOKED,
+    "a name for every cooked state");
 
 
 bool debug_mode;
@@ -165,6 +127,7 @@ void setupHandler() {
   blink_state = 0;
   alarm_status = 0xff;
   cooked_alarm_status = 0xff;
+  edge_lost_status = ~0UL;
   // turn off all LEDs
   digitalWrite(PIN_LED0, HIGH);
   digitalWrite(PIN_LED1, HIGH);
@@ -172,76 +135,110 @@ void setupHandler() {
 }
 
 //
-// P18 state machine stuff
+// Edge capture.  The interrupt notes the time of each change on either
+// input, and both inputs' levels, in a ring for alarm_decode() to
+// take from loop().  If loop() falls a whole ring behind, the edges
+// since are lost; the decoder starts again from the inputs as they are.
+// edge-lost counts the times that happened since boot.
 //
-unsigned char p18_current_state;
-long p18_state_enter_time;		// set to zero for no pending timeout
-const long p18_timeout = 1500;		// timeouts occur after 1.1 seconds
+#define	EDGE_RING	32		// a power of two
+
+#define	IN_P17		2		// bits in edge.in, as in rawstate
+#define	IN_P18		1
+
+struct edge {
+	unsigned long t;		// millis()
+	unsigned char in;		// IN_ bits, active
+};
+
+volatile struct edge edge_ring[EDGE_RING];
+volatile unsigned char edge_head;	// next the interrupt fills
+unsigned char edge_tail;		// next alarm_decode() takes
+volatile bool edge_overflow;
+unsigned long edge_lost;		// times the ring overflowed
+
+unsigned char alarm_raw;		// inputs as of the last edge
+unsigned char alarm_cooked;
+
+// Both inputs, active low
+static inline unsigned char IRAM_ATTR edge_inputs()
+{
+	uint32_t in = GPI;
+
+	return ((in & (1 << PIN_INPUT17))? 0: IN_P17) |
+	    ((in & (1 << PIN_INPUT18))? 0: IN_P18);
+}
 
-void p18_reset()
+void IRAM_ATTR edgeIsr()
 {
-	p18_current_state = S_idle_low;
-	p18_state_enter_time = 0;
+	unsigned char h = edge_head;
+
+	if ((unsigned char)(h - edge_tail) >= EDGE_RING) {
+		edge_overflow = true;
+		return;
+	}
+	edge_ring[h % EDGE_RING].t = millis();
+	edge_ring[h % EDGE_RING].in = edge_inputs();
+	edge_head = h + 1;
 }
 
-void p18_machine(unsigned char p18)
+// Run the decoder on the inputs being in at time t
+void alarm_input(unsigned char in, unsigned long t)
 {
-	long now;
-	unsigned char p;
-
-	if (p18)
-		p18 = 1;
-	now = millis();
-	if (p18_state_enter_time > 0 &&
-	    now - p18_state_enter_time >= p18_timeout) {
-	    	p18 = 2;
-		p18_state_enter_time = 0;
+	alarm_raw = in;
+	if (!(in & IN_P17)) {
+		p18_reset();
+		alarm_cooked = P_Disarmed;
+	} else {
+		p18_machine(in & IN_P18, t);
+		alarm_cooked = p18_fsm.output[p18_current_state];
 	}
-	p = p18_state_table[p18_current_state][p18];
-	if (p != p18_current_state)
-		p18_state_enter_time = now;
-	p18_current_state = p;
 }
 
 //
-// Read the alarm pins
-// If they have change, tell the world.
+// Called every loop() pass, connected or not.  Decode the edges caught
+// since the last pass, then any timeout that has come due since.
+//
+void alarm_decode()
+{
+	unsigned long now = millis();
+	struct edge e;
+
+	while (edge_tail != edge_head) {
+		e.t = edge_ring[edge_tail % EDGE_RING].t;
+		e.in = edge_ring[edge_tail % EDGE_RING].in;
+		edge_tail++;
+		alarm_input(e.in, e.t);
+	}
+	if (edge_overflow) {
+		edge_lost++;
+		p18_reset();
+		edge_overflow = false;
+		alarm_input(edge_inputs(), now);
+	}
+	if (alarm_raw & IN_P17) {
+		p18_expire(now);
+		alarm_cooked = p18_fsm.output[p18_current_state];
+	}
+}
+
+//
+// If the alarm state has changed, tell the world.
 //
 void sensor() {
-  unsigned char p17, p18;
-  unsigned char s, c;
-
-  p17 = !digitalRead(PIN_INPUT17);
-  p18 = !digitalRead(PIN_INPUT18);
-
-  // Get the raw status`
-  s = 0;
-  if (p17)
-    s = 2;
-  if (p18)
-    s++;
-
-  // Calculate the cooked alarm status
-  if (!p17) {
-  	p18_reset();
-	c = P_Disarmed;
-  } else {
-  	p18_machine(p18);
-	c = p18_state_output[p18_current_state];
+  if (alarm_raw != alarm_status) {
+    alarm_status = alarm_raw;
+    alarmStateNode.setProperty("rawstate").send(String(alarm_status));
   }
 
-  // Now send the information to homie.
-  // Don't do this until after running the state machine
-  // or the timing may get messed up
-
-  if (s != alarm_status) {
-    alarm_status = s;
-    alarmStateNode.setProperty("rawstate").send(String(alarm_status));
+  if (alarm_cooked != cooked_alarm_status) {
+    alarmStateNode.setProperty("state").send(cooked_alarm_states[alarm_cooked]);
+    cooked_alarm_status = alarm_cooked;
   }
 
-  if (c != cooked_alarm_status) {
-    alarmStateNode.setProperty("state").send(cooked_alarm_states[c]);
-    cooked_alarm_status = c;
+  if (edge_lost != edge_lost_status) {
+    edge_lost_status = edge_lost;
+    alarmStateNode.setProperty("edge-lost").send(String(edge_lost_status));
   }
 }
 
@@ -325,7 +322,16 @@ void setup() {
   alarmStateNode.advertise("rawstate")
                          .setName("Raw State")
 			 .setDatatype("integer");
+  alarmStateNode.advertise("edge-lost")
+                         .setName("Edge Ring Overflows")
+			 .setDatatype("integer");
   Homie.disableLedFeedback(); // we want to control the LED
+
+  // start the decoder from the inputs as they are, then follow the edges
+  p18_reset();
+  alarm_input(edge_inputs(), millis());
+  attachInterrupt(digitalPinToInterrupt(PIN_INPUT17), edgeIsr, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(PIN_INPUT18), edgeIsr, CHANGE);
   
   Homie.setup();
 }
@@ -361,5 +367,6 @@ void loop() {
   /*
    * NORMAL MODE
    */
+  alarm_decode();
   Homie.loop();
-}
+}
@@ -0,0 +1,328 @@
+//
+// Native tests for the pin 18 decoder: pio test -e native
+//
+// The decoder used to be polled once a millisecond from loopHandler(),
+// with its own copy of the table (version 0.6 and before).  That poller
+// is kept here, as it was but for names and the clock, as the reference: the fsm<>
+// decoder, run on edges and timeouts, must give the same cooked state
+// at every millisecond of every pulse sequence we can think of.
+//
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include "p18.h"
+
+//
+// The old poller.  now is what millis() returned.
+//
+static const unsigned char old_state_table[N_STATES][3] = {
+	{S_idle_low, S_h1, S_idle_low},		// S_idle_low
+	{S_h2, S_h1, S_h4},			// S_h1
+	{S_h2, S_h3, S_idle_low},		// S_h2
+	{S_h2, S_h3, S_h4},			// S_h3
+	{S_two_sec, S_h4, S_high},		// S_h4
+	{S_two_sec, S_h1, S_two_sec},		// S_two_sec
+	{S_l1, S_high, S_high},			// S_high
+	{S_l1, S_l2, S_idle_low},		// S_l1
+	{S_h2, S_l2, S_l3},			// S_l2
+	{S_two_sec, S_l3, S_high},		// S_l3
+};
+
+static const unsigned char old_state_output[N_STATES] = {
+	P_Off,
+	P_Two_Sec,
+	P_Pulse,
+	P_Pulse,
+	P_Two_Sec,
+	P_Two_Sec,
+	P_High,
+	P_High,
+	P_High,
+	P_High,
+};
+
+static unsigned char old_current_state;
+static long old_state_enter_time;		// set to zero for no pending timeout
+
+static void old_reset()
+{
+	old_current_state = S_idle_low;
+	old_state_enter_time = 0;
+}
+
+static void old_machine(unsigned char p18, long now)
+{
+	unsigned char p;
+
+	if (p18)
+		p18 = 1;
+	if (old_state_enter_time > 0 &&
+	    now - old_state_enter_time >= p18_timeout) {
+	    	p18 = 2;
+		old_state_enter_time = 0;
+	}
+	p = old_state_table[old_current_state][p18];
+	if (p != old_current_state)
+		old_state_enter_time = now;
+	old_current_state = p;
+}
+
+//
+// A pulse sequence: pin 18 starts at level and flips after each of
+// n durations, then holds for TAIL ms.
+//
+#define	MAX_SEGS	8
+#define	TAIL		5000
+
+struct train {
+	unsigned char level;
+	unsigned char n;
+	unsigned short dur[MAX_SEGS];
+};
+
+static unsigned long train_length(const struct train *tr)
+{
+	unsigned long len = TAIL;
+	unsigned char i;
+
+	for (i = 0; i < tr->n; i++)
+		len += tr->dur[i];
+	return len;
+}
+
+//
+// Run the train through the fsm<> decoder from time t0, the way
+// alarm_decode() does: each edge at its time, and timeouts as they fall
+// due.  out[ms] is the cooked state at each millisecond.
+// Returns false if an edge landed in the same millisecond as a timeout;
+// the old poller took the timeout then and the edge a millisecond later,
+// so the two are not expected to agree on those.
+//
+static bool run_fsm(const struct train *tr, unsigned long t0, unsigned char *out)
+{
+	unsigned long len = train_length(tr);
+	unsigned char level = tr->level;
+	unsigned long edge = t0;
+	bool clean = true;
+	unsigned char i = 0;
+	unsigned long ms;
+
+	p18_reset();
+	p18_machine(level, t0);
+	edge += tr->n? tr->dur[0]: len;
+	for (ms = 0; ms < len; ms++) {
+		unsigned long t = t0 + ms;
+
+		if (t == edge) {
+			p18_expire(t - 1);
+			if (p18_timing && (long)(t - p18_state_enter_time) >= p18_timeout)
+				clean = false;
+			level = !level;
+			p18_machine(level, t);
+			i++;
+			edge += i < tr->n? tr->dur[i]: len;
+		}
+		p18_expire(t);
+		out[ms] = p18_fsm.output[p18_current_state];
+	}
+	return clean;
+}
+
+static void run_old(const struct train *tr, long t0, unsigned char *out)
+{
+	unsigned long len = train_length(tr);
+	unsigned long ms, seg = 0;
+	unsigned char level = tr->level;
+	unsigned char i = 0;
+
+	old_reset();
+	for (ms = 0; ms < len; ms++, seg++) {
+		if (i < tr->n && seg == tr->dur[i]) {
+			level = !level;
+			seg = 0;
+			i++;
+		}
+		old_machine(level, t0 + ms);
+		out[ms] = old_state_output[old_current_state];
+	}
+}
+
+static unsigned char out_fsm[MAX_SEGS * 5000 + TAIL];
+static unsigned char out_old[MAX_SEGS * 5000 + TAIL];
+
+// Compare the two on one train; returns false if it had to be skipped
+static bool compare(const struct train *tr)
+{
+	unsigned long len = train_length(tr);
+	unsigned long ms;
+	char msg[200];
+
+	if (!run_fsm(tr, 1000, out_fsm))
+		return false;
+	run_old(tr, 1000, out_old);
+	for (ms = 0; ms < len; ms++)
+		if (out_fsm[ms] != out_old[ms]) {
+			snprintf(msg, sizeof msg, "start %d, %d segments, first %d ms, at %lu ms",
+			    tr->level, tr->n, tr->dur[0], ms);
+			TEST_ASSERT_EQUAL_UINT8_MESSAGE(out_old[ms], out_fsm[ms], msg);
+		}
+	return true;
+}
+
+//
+// Every sequence of up to 5 segments, from either level, with each
+// segment one of these lengths.  They sit either side of the timeout
+// and of two timeouts, and include a short pulse and a long hold.
+//
+static const unsigned short durations[] = {100, 700, 1499, 1501, 2999, 3001, 4000};
+#define	N_DURATIONS	(sizeof durations / sizeof durations[0])
+
+void test_every_sequence_matches_old_poller(void)
+{
+	struct train tr;
+	unsigned long compared = 0, skipped = 0;
+	unsigned long k, combos;
+	unsigned char n, i;
+	char msg[100];
+
+	for (tr.level = 0; tr.level <= 1; tr.level++)
+		for (n = 0; n <= 5; n++) {
+			for (combos = 1, i = 0; i < n; i++)
+				combos *= N_DURATIONS;
+			for (k = 0; k < combos; k++) {
+				unsigned long c = k;
+
+				tr.n = n;
+				for (i = 0; i < n; i++) {
+					tr.dur[i] = durations[c % N_DURATIONS];
+					c /= N_DURATIONS;
+				}
+				if (compare(&tr))
+					compared++;
+				else
+					skipped++;
+			}
+		}
+	snprintf(msg, sizeof msg, "%lu sequences agree, %lu with an edge on a timeout skipped",
+	    compared, skipped);
+	TEST_MESSAGE(msg);
+	TEST_ASSERT_TRUE(skipped == 0);
+}
+
+// Timeouts are timed from the edges, so millis() wrapping changes nothing
+void test_millis_wrap(void)
+{
+	struct train tr = {1, 6, {100, 700, 1501, 100, 3001, 2999}};
+	static unsigned char out_wrap[sizeof out_fsm];
+	unsigned long len = train_length(&tr);
+
+	run_fsm(&tr, 1000, out_fsm);
+	run_fsm(&tr, 0UL - 4000, out_wrap);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(out_fsm, out_wrap, len);
+}
+
+//
+// fsm_valid() catches each kind of broken table
+//
+constexpr fsm<3, 2, 2> good = {{{0, 1}, {2, 1}, {0, 2}}, {0, 1, 1}};
+constexpr fsm<3, 2, 2> out_of_range = {{{0, 1}, {3, 1}, {0, 2}}, {0, 1, 1}};
+constexpr fsm<3, 2, 2> unreachable = {{{0, 0}, {2, 1}, {0, 2}}, {0, 1, 1}};
+constexpr fsm<3, 2, 2> stuck = {{{0, 1}, {2, 1}, {2, 2}}, {0, 1, 1}};
+constexpr fsm<3, 2, 2> bad_output = {{{0, 1}, {2, 1}, {0, 2}}, {0, 2, 1}};
+
+void test_fsm_checks(void)
+{
+	TEST_ASSERT_TRUE(fsm_valid(good, 0));
+	TEST_ASSERT_FALSE(fsm_valid(out_of_range, 0));
+	TEST_ASSERT_FALSE(fsm_valid(unreachable, 0));
+	TEST_ASSERT_FALSE(fsm_valid(stuck, 0));
+	TEST_ASSERT_FALSE(fsm_valid(bad_output, 0));
+	TEST_ASSERT_TRUE(fsm_valid(p18_fsm, S_idle_low));
+}
+
+//
+// What the panel sends for each alarm state, and what it should decode
+// to by the end of it
+//
+static unsigned char decode(const struct train *tr)
+{
+	run_fsm(tr, 1000, out_fsm);
+	return out_fsm[train_length(tr) - TAIL - 1];
+}
+
+void test_recorded_trains(void)
+{
+	struct train quiet = {0, 1, {6000}};
+	struct train steady = {1, 1, {6000}};
+	struct train fire = {1, 8, {200, 200, 200, 200, 200, 200, 200, 200}};
+	struct train away = {1, 5, {2000, 2000, 2000, 2000, 2000}};
+
+	TEST_ASSERT_EQUAL_UINT8(P_Off, decode(&quiet));
+	TEST_ASSERT_EQUAL_UINT8(P_High, decode(&steady));
+	TEST_ASSERT_EQUAL_UINT8(P_Pulse, decode(&fire));
+	TEST_ASSERT_EQUAL_UINT8(P_Two_Sec, decode(&away));
+}
+
+//
+// Benchmark: what an hour of activity costs each way.  The poller runs
+// every millisecond; the fsm<> decoder runs once per edge, plus a
+// timeout check each loop() pass, taken here as every millisecond too.
+//
+void test_benchmark(void)
+{
+	const unsigned long hour = 3600000UL;
+	unsigned long ms, edges = 0, next = 1000;
+	unsigned char level = 0, sink = 0;
+	unsigned long seed = 1;
+	double old_ns, fsm_ns;
+	char msg[160];
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	old_reset();
+	for (ms = 1000; ms < 1000 + hour; ms++) {
+		if (ms == next) {
+			level = !level;
+			seed = seed * 1103515245 + 12345;
+			next += 100 + (seed >> 16) % 3000;
+		}
+		old_machine(level, ms);
+		sink += old_state_output[old_current_state];
+	}
+	old_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	level = 0;
+	next = 1000;
+	seed = 1;
+	p18_reset();
+	for (ms = 1000; ms < 1000 + hour; ms++) {
+		if (ms == next) {
+			level = !level;
+			seed = seed * 1103515245 + 12345;
+			next += 100 + (seed >> 16) % 3000;
+			p18_machine(level, ms);
+			edges++;
+		}
+		p18_expire(ms);
+		sink += p18_fsm.output[p18_current_state];
+	}
+	fsm_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	snprintf(msg, sizeof msg, "old poller %.2f ns/ms, fsm %.2f ns/ms, %lu edges in an hour (%d)",
+	    old_ns / hour, fsm_ns / hour, edges, sink & 1);
+	TEST_MESSAGE(msg);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_fsm_checks);
+	RUN_TEST(test_every_sequence_matches_old_poller);
+	RUN_TEST(test_millis_wrap);
+	RUN_TEST(test_recorded_trains);
+	RUN_TEST(test_benchmark);
+	return UNITY_END();
+}
@@ -1,249 +1,1499 @@
-/*
- * Code to manage a WiFi controlled environment sensor
- * 
- * Inputs:
- *  Ambient LUX, temp, and humidity
- * Outputs:
- *  None
- *
- * Implements 3 homie sensors
- *
- * Major version 2 of this code upgrades to Homie v3
- * 2.0.1: turn lux sensor on, begin debugging this
- * 2.0.2: temp and hummidity less often
- */
-
-#include <Adafruit_Sensor.h>
-#include <Adafruit_TSL2561_U.h>
-#include <DHT.h>
-#include <DHT_U.h>
-#include <Homie.h>
-
-#define FIRMWARE_NAME     "env-sense"
-#define FIRMWARE_VERSION  "2.0.2"
-
-
-/*
- * IO Pins
- */
-const int PIN_SCL = D1;
-const int PIN_SDA = D2;
-const int PIN_LED = 2;
-const int PIN_DHT = D5;
-
-/*
- * Misc globals
- */
-volatile long time_base;
-long now;
-long last_light_time;
-long published_light_time;
-int light;
-const long light_period = 3;	// sample every 30 seconds XXX actually, for debugging do this more often
-float temp;
-float humidity;
-long last_temp_time;
-long published_temp_time;
-const long temp_period = 30;	// sample every 30 seconds
-
-Adafruit_TSL2561_Unified tsl = Adafruit_TSL2561_Unified(TSL2561_ADDR_FLOAT, 12345);
-#define DHTTYPE DHT22   // DHT 22  (AM2302) type of temp/humidity sensor we are using
-DHT dht(PIN_DHT, DHTTYPE);
-
-HomieNode luxNode("lux", "lux", "sensor");
-HomieNode tempNode("temp", "temp", "sensor");
-HomieNode humidityNode("humidity", "humidity", "sensor");
-
-void configureSensor(void)
-{
-  /* You can also manually set the gain or enable auto-gain support */
-  // tsl.setGain(TSL2561_GAIN_1X);      /* No gain ... use in bright light to avoid sensor saturation */
-  // tsl.setGain(TSL2561_GAIN_16X);     /* 16x gain ... use in low light to boost sensitivity */
-  tsl.enableAutoRange(true);          /* Auto-gain ... switches automatically between 1x and 16x */
-  
-  /* Changing the integration time gives you better sensor resolution (402ms = 16-bit data) */
-  // tsl.setIntegrationTime(TSL2561_INTEGRATIONTIME_13MS);      /* fast but low resolution */
-     tsl.setIntegrationTime(TSL2561_INTEGRATIONTIME_101MS);  /* medium resolution and speed   */
-  // tsl.setIntegrationTime(TSL2561_INTEGRATIONTIME_402MS);  /* 16-bit data but slowest conversions */
-}
-
-/****
- *
- * Message Handlers
- *
- * NOTE: the message handlers are called asynchronously from the TCP/IP upcal.
- * We assume this means they may be called from an interrupt at any time.
- *
- ****/
-
-// Broadcast handler.  Useful for time base.
-bool broadcastHandler(const String& level, const String& value) {
-  // Only broadcast we know about it IOTtime.
-  if (level == "IOTtime") {
-	long t = value.toInt();
-
-	if (t < 0) return false;
-
-	time_base = t - millis()/1000;
-	return true;
-  }
-  return false;
-}
-
-/*
- * This code called once to set up, but only after completely connected.
- */
-void setupHandler() {
-  published_light_time = 0;
-  published_temp_time = 0;
-  luxNode.setProperty("unit").send("lux");
-  tempNode.setProperty("unit").send("F");
-}
-
-void setup() {
-  void loopHandler();
-  Serial.begin(115200);
-  Serial.println("Lux/Temp/RH sensors");
-  Serial.println(FIRMWARE_VERSION);
-  Serial << endl << endl;
-
-  configureSensor();
-  light = 0;
-  last_light_time = 0;
-  dht.begin();
-  temp = 0.;
-  humidity = 0.;
-  last_temp_time = 0;
-
-  time_base = 0;
-
-  Homie_setFirmware(FIRMWARE_NAME, FIRMWARE_VERSION);
-  Homie.setSetupFunction(setupHandler).setLoopFunction(loopHandler);
-
-  luxNode.advertise("lux").
-	setName("Light Intensity").
-	setDatatype("integer");
-
-  luxNode.advertise("unit").
-  	setName("Lux Unit").
-	setDatatype("string");
-
-  luxNode.advertise("time-last-update").
-	setName("Update Time").
-	setDatatype("integer");
-
-  tempNode.advertise("temp").
-	setName("Temperature").
-	setDatatype("integer");
-
-  tempNode.advertise("unit").
-	setName("Temp Unit").
-	setDatatype("string");
-
-  tempNode.advertise("time-last-update").
-	setName("Update Time").
-	setDatatype("integer");
-
-  humidityNode.advertise("humidity").
-	setName("Humidity").
-	setDatatype("integer");
-
-  humidityNode.advertise("time-last-update").
-	setName("Update Time").
-	setDatatype("integer");
-  
-
-  Homie.setBroadcastHandler(broadcastHandler);
-
-  Homie.setup();
-}
-
-/*
- * This routine takes ~ 100ms to run. (Integration time)
- * Returns how much light in lux.
- * A return value of zero indicates sensor is overloaded.  No data.
- */
-static int getLight()
-{
-  sensors_event_t event;
-  tsl.getEvent(&event);
-  return event.light;
-}
-
-static float getTemp()
-{
-  return dht.readTemperature(true);
-}
-
-static float getHumidity()
-{
-  return dht.readHumidity();
-}
-
-// returns true if we actually read the sensor
-static bool processLight()
-{
-  if (now - last_light_time >= light_period) {
-/*XXX*/if (0) {delay(30); light = 995;}else	// test to see if the delay function is the culprit
-    light = getLight();
-    last_light_time = now;
-    return true;
-  }
-  return false;
-}
-
-static void processTH()
-{
-  if (now - last_temp_time >= temp_period) {
-    temp = getTemp();
-    humidity = getHumidity();
-    last_temp_time = now;
-  }
-}
-
-
-/*
- * This code is called once per loop(), but only
- * when connected to WiFi and MQTT broker
- */
-void loopHandler() {
-  // only publish sensor value if we've a new sample
-  if (published_light_time != last_light_time) {
-    luxNode.setProperty("lux").send(String(light));
-    if (time_base)
-      luxNode.setProperty("time-last-update").send(String(last_light_time));
-    published_light_time = last_light_time;
-  }
-  if (published_temp_time != last_temp_time && !isnan(temp) && !isnan(humidity)) {
-    tempNode.setProperty("temp").send(String(temp));
-    if (time_base)
-      tempNode.setProperty("time-last-update").send(String(last_temp_time));
-    humidityNode.setProperty("humidity").send(String(humidity));
-    humidityNode.setProperty("time-last-update").send(String(last_temp_time));
-    published_temp_time = last_temp_time;
-  }
-}
-
-/*
- * This code runs repeatedly, whether connected to not.
- */
-void loop() {
-
-#ifdef maybe_a_bug
-  now = time_base + millis()/1000;
-#else
-  long t;
-
-  t = millis()/1000;
-  noInterrupts();
-  now = time_base + t;
-  interrupts();
-#endif
-
-
-  // because these sensors take a while to read never read
-  // both of them on the same iteration of loop().
-  if (!processLight())
-    processTH();
-  Homie.loop();
-}
+/*
+ * Code to manage a WiFi controlled environment sensor
+ * 
+ * Inputs:
+ *  Ambient LUX, temp, and humidity
+ * Outputs:
+ *  None
+ *
+ * Implements 3 homie sensors
+ *
+ * Major version 2 of this code upgrades to Homie v3
+ * 2.0.1: turn lux sensor on, begin debugging this
+ * 2.0.2: temp and hummidity less often
+ * 2.1.0: light sensor read without blocking, loop timing histogram
+ * 2.2.0: temp/humidity sensor timed by interrupt, without the DHT library
+ * 2.3.0: publish min/max/mean/stddev/count per window instead of every sample
+ * 2.4.0: only publish a window when it has changed enough, or on a heartbeat
+ * 2.5.0: keep windows in flash while offline, backfill them on reconnect
+ * 2.6.0: sample faster while readings change, slower while they don't
+ * 2.7.0: battery build, sleeping between readings and sending them in batches
+ * 2.8.0: light integration time follows the light, I2C at 400 kHz
+ */
+
+#include <Adafruit_Sensor.h>
+#include <Adafruit_TSL2561_U.h>
+#include <Homie.h>
+#include <Wire.h>
+
+#define FIRMWARE_NAME     "env-sense"
+#define FIRMWARE_VERSION  "2.8.0"
+
+
+/*
+ * IO Pins
+ */
+const int PIN_SCL = D1;
+const int PIN_SDA = D2;
+const int PIN_LED = 2;
+const int PIN_DHT = D5;
+
+/*
+ * Misc globals
+ */
+volatile long time_base;
+long now;
+long last_light_time;
+int light;
+float temp;
+float humidity;
+long last_temp_time;
+
+/*
+ * Light sensor state.  See processLight().
+ */
+#define	LIGHT_IDLE		0	// powered down, waiting for the next sample
+#define	LIGHT_INTEGRATING	1	// powered up, integrating until light_deadline
+unsigned char light_state;
+unsigned long light_deadline;	// millis() when the integration is done
+unsigned long light_start;	// millis() the sample was started
+unsigned char light_range;	// in light_ranges[]
+
+/*
+ * Light sensor ranges, least sensitive first.  An integration that
+ * reads under lo counts moves one range up; lo is the library
+ * auto-range's threshold for that integration time.  One over hi moves
+ * one down; hi is where the range below would read ten times its lo,
+ * so it keeps enough resolution and a step never comes straight back.
+ * Each range is 7.4 (13.7 to 101 ms), 16 (gain) or 4 (101 to 402 ms)
+ * times as sensitive as the one before.  So bright light takes 13 ms,
+ * and only a dim room 101 or 402 ms.
+ */
+const struct {
+  tsl2561IntegrationTime_t time;
+  tsl2561Gain_t gain;
+  uint16_t ms;			// to wait for the integration
+  uint16_t lo, hi;
+} light_ranges[] = {
+  {TSL2561_INTEGRATIONTIME_13MS, TSL2561_GAIN_1X, TSL2561_DELAY_INTTIME_13MS, TSL2561_AGC_TLO_13MS, 0xffff},
+  {TSL2561_INTEGRATIONTIME_101MS, TSL2561_GAIN_1X, TSL2561_DELAY_INTTIME_101MS, TSL2561_AGC_TLO_101MS, 7400},
+  {TSL2561_INTEGRATIONTIME_101MS, TSL2561_GAIN_16X, TSL2561_DELAY_INTTIME_101MS, TSL2561_AGC_TLO_101MS, 32000},
+  {TSL2561_INTEGRATIONTIME_402MS, TSL2561_GAIN_16X, TSL2561_DELAY_INTTIME_402MS, 0, 8000},
+};
+#define	N_LIGHT_RANGES	(sizeof light_ranges / sizeof light_ranges[0])
+
+// For the stats, since they were last published
+unsigned long light_samples;
+unsigned long light_ms;		// total conversion time
+unsigned long light_i2c_bytes;	// on the wire, address bytes included
+
+/*
+ * Loop timing.  Each loop() pass is timed and counted in one bucket;
+ * the counts and the longest pass are published every STATS_PERIOD.
+ */
+#define	STATS_PERIOD	60000	// ms
+#define	LOOP_BUCKETS	8
+const unsigned long loop_bucket_us[LOOP_BUCKETS - 1] = {	// upper bounds
+	500, 1000, 2000, 5000, 10000, 50000, 100000
+};
+unsigned long loop_hist[LOOP_BUCKETS];
+unsigned long loop_max_us;
+unsigned long stats_time;
+
+Adafruit_TSL2561_Unified tsl = Adafruit_TSL2561_Unified(TSL2561_ADDR_FLOAT, 12345);
+/*
+ * Temp/humidity sensor state, a DHT22 (AM2302).  See processTH().
+ */
+#define	DHT_IDLE	0	// waiting for the next sample
+#define	DHT_START	1	// holding the line low to wake the sensor
+#define	DHT_READING	2	// line released, the interrupt is timing the reply
+#define	DHT_START_MS	2	// start pulse, at least 1 ms
+#define	DHT_READ_MS	10	// the reply takes about 5 ms
+#define	DHT_RETRY_MS	2500	// the sensor needs 2 s between reads
+#define	DHT_RETRIES	3	// tries after the first before giving up till next period
+#define	DHT_EDGES	48	// 42 falling edges in a reply, and some slack
+#define	DHT_ONE_US	100	// a bit is ~76 us falling edge to falling edge for 0, ~120 for 1
+unsigned char dht_state;
+unsigned long dht_deadline;	// millis() to move on to the next state
+unsigned char dht_tries;	// tries so far this sample
+volatile unsigned long dht_edge[DHT_EDGES];	// micros() of each falling edge
+volatile unsigned char dht_nedge;
+
+// Since boot
+unsigned long dht_reads;	// frames decoded
+unsigned long dht_bad_checksum;
+unsigned long dht_timeouts;	// too few edges
+unsigned long dht_retries;
+unsigned long dht_failures;	// gave up for the period
+
+HomieNode luxNode("lux", "lux", "sensor");
+HomieNode tempNode("temp", "temp", "sensor");
+HomieNode humidityNode("humidity", "humidity", "sensor");
+HomieNode statsNode("stats", "stats", "stats");
+HomieNode backfillNode("backfill", "backfill", "backfill");
+
+/*
+ * Windowed aggregation.
+ *
+ * Rather than publish every sample, each sensor keeps the running
+ * count, mean, variance (Welford's method), min and max of the samples
+ * in the current window, and publishes them once the window is over.
+ * Windows are whole multiples of the window length in IOTtime, so all
+ * our devices' windows line up.  The value property (lux, temp,
+ * humidity) carries the mean.
+ *
+ * For debugging, raw can be turned on to also publish every sample as
+ * the value property, as this code used to.
+ *
+ * A closed window is only published if its mean has moved away from
+ * the last mean we published by more than the deadband: deadband in
+ * the sensor's units, or deadband-pct percent of the last value,
+ * whichever is bigger.  The band stays centred on the published value
+ * rather than following each window, so a slow drift is still reported
+ * once it adds up, and a value sitting on the edge of the band doesn't
+ * chatter.  However little changes, a window is published at least
+ * every heartbeat seconds so we can tell the sensor is alive.
+ */
+#define	AGG_WINDOW	300	// default window, seconds
+#define	AGG_WINDOW_MIN	10
+#define	AGG_WINDOW_MAX	86400
+#define	AGG_HEARTBEAT	3600	// default heartbeat, seconds
+
+struct agg {
+  HomieNode *node;
+  const char *name;		// value property
+  long window;			// seconds
+  bool raw;			// publish every sample too
+  float deadband;		// sensor units
+  float deadband_pct;		// percent of the published value
+  long heartbeat;		// seconds
+
+  // the last sample
+  bool sampled;
+  float last;
+
+  // the window being collected
+  long number;			// now / window
+  unsigned int n;
+  float mean, m2, min, max;
+
+  // the last window to close, waiting for loopHandler()
+  bool ready;
+  long end;
+  unsigned int r_n;
+  float r_mean, r_min, r_max, r_stddev;
+
+  // the last sample, if raw
+  bool raw_ready;
+  float raw_value;
+  long raw_time;
+
+  // what we last published
+  bool published;		// false forces the next window out
+  float published_mean;
+  long published_time;
+  unsigned long publishes;	// windows sent
+  unsigned long suppressed;	// windows not sent, inside the deadband
+};
+
+struct agg agg_lux = {&luxNode, "lux", AGG_WINDOW, false, 5., 10., AGG_HEARTBEAT};
+struct agg agg_temp = {&tempNode, "temp", AGG_WINDOW, false, 0.5, 0., AGG_HEARTBEAT};
+struct agg agg_humidity = {&humidityNode, "humidity", AGG_WINDOW, false, 2., 0., AGG_HEARTBEAT};
+struct agg *const aggs[] = {&agg_lux, &agg_temp, &agg_humidity};
+#define	N_AGGS	(sizeof aggs / sizeof aggs[0])
+
+/*
+ * Close the window if now is past it.  A window with samples in it
+ * is kept for loopHandler() to publish.
+ */
+static void aggTick(struct agg *a, long t)
+{
+  if (t / a->window == a->number)
+    return;
+  if (a->n > 0) {
+    a->ready = true;
+    a->end = (a->number + 1) * a->window;
+    a->r_n = a->n;
+    a->r_mean = a->mean;
+    a->r_min = a->min;
+    a->r_max = a->max;
+    a->r_stddev = a->n > 1? sqrt(a->m2 / (a->n - 1)): 0.;
+  }
+  a->number = t / a->window;
+  a->n = 0;
+}
+
+// Deadband around value v for aggregate a
+static float aggBand(struct agg *a, float v)
+{
+  float band;
+
+  band = a->deadband_pct / 100. * fabs(v);
+  if (band < a->deadband)
+    band = a->deadband;
+  return band;
+}
+
+/*
+ * Add a sample taken at t to its window.  Returns how far it is from
+ * the sample before, in deadbands.
+ */
+static float aggAdd(struct agg *a, float v, long t)
+{
+  float d, moved;
+
+  aggTick(a, t);
+  if (a->n == 0) {
+    a->mean = 0.;
+    a->m2 = 0.;
+    a->min = v;
+    a->max = v;
+  }
+  a->n++;
+  d = v - a->mean;
+  a->mean += d / a->n;
+  a->m2 += d * (v - a->mean);
+  if (v < a->min)
+    a->min = v;
+  if (v > a->max)
+    a->max = v;
+
+  if (a->raw) {
+    a->raw_ready = true;
+    a->raw_value = v;
+    a->raw_time = t;
+  }
+
+  moved = 0.;
+  if (a->sampled) {
+    d = fabs(v - a->last);
+    moved = d > 0.? d / fmax(aggBand(a, a->last), 1e-6): 0.;
+  }
+  a->sampled = true;
+  a->last = v;
+  return moved;
+}
+
+// Is the closed window in a worth publishing?
+static bool aggChanged(struct agg *a)
+{
+  if (!a->published || now - a->published_time >= a->heartbeat)
+    return true;
+  return fabs(a->r_mean - a->published_mean) > aggBand(a, a->published_mean);
+}
+
+// Send what aggregate a has ready
+static void aggPublish(struct agg *a)
+{
+  HomieNode *node = a->node;
+
+  if (a->raw_ready) {
+    a->raw_ready = false;
+    node->setProperty(a->name).send(String(a->raw_value));
+    if (time_base)
+      node->setProperty("time-last-update").send(String(a->raw_time));
+  }
+  if (a->ready) {
+    a->ready = false;
+    if (!aggChanged(a)) {
+      a->suppressed++;
+      return;
+    }
+    a->published = true;
+    a->published_mean = a->r_mean;
+    a->published_time = now;
+    a->publishes++;
+
+    if (!a->raw)
+      node->setProperty(a->name).send(String(a->r_mean));
+    node->setProperty("min").send(String(a->r_min));
+    node->setProperty("max").send(String(a->r_max));
+    node->setProperty("stddev").send(String(a->r_stddev));
+    node->setProperty("count").send(String(a->r_n));
+    if (time_base && a->end > time_base)	// not a window from before we knew the time
+      node->setProperty("time-last-update").send(String(a->end));
+    node->setProperty("publishes").send(String(a->publishes));
+    node->setProperty("suppressed").send(String(a->suppressed));
+  }
+}
+
+// Window length for aggregate a, in seconds
+static bool aggWindowHandler(struct agg *a, const String& value)
+{
+  long w;
+
+  for (unsigned j = 0; j < value.length(); j++)
+    if (!isDigit(value.charAt(j)))
+      return false;
+  w = value.toInt();
+  if (w < AGG_WINDOW_MIN || w > AGG_WINDOW_MAX)
+    return false;
+
+  a->window = w;
+  a->number = now / w;		// the window in progress just carries on
+  a->node->setProperty("window").send(value);
+  return true;
+}
+
+// Raw sample publishing for aggregate a, true or false
+static bool aggRawHandler(struct agg *a, const String& value)
+{
+  if (value != "true" && value != "false")
+    return false;
+
+  a->raw = value == "true";
+  a->raw_ready = false;
+  a->node->setProperty("raw").send(value);
+  return true;
+}
+
+// Parse a non-negative number, no bigger than max
+static bool aggNumber(const String& value, float max, float *f)
+{
+  bool point = false;
+
+  if (value.length() == 0)
+    return false;
+  for (unsigned j = 0; j < value.length(); j++) {
+    if (value.charAt(j) == '.' && !point)
+      point = true;
+    else if (!isDigit(value.charAt(j)))
+      return false;
+  }
+  *f = value.toFloat();
+  return *f <= max;
+}
+
+// Absolute deadband for aggregate a, in the sensor's units
+static bool aggDeadbandHandler(struct agg *a, const String& value)
+{
+  if (!aggNumber(value, 100000., &a->deadband))
+    return false;
+  a->node->setProperty("deadband").send(value);
+  return true;
+}
+
+// Relative deadband for aggregate a, percent
+static bool aggDeadbandPctHandler(struct agg *a, const String& value)
+{
+  if (!aggNumber(value, 100., &a->deadband_pct))
+    return false;
+  a->node->setProperty("deadband-pct").send(value);
+  return true;
+}
+
+// Longest time between publishes for aggregate a, in seconds
+static bool aggHeartbeatHandler(struct agg *a, const String& value)
+{
+  float h;
+
+  if (!aggNumber(value, AGG_WINDOW_MAX, &h) || h < AGG_WINDOW_MIN)
+    return false;
+  a->heartbeat = h;
+  a->node->setProperty("heartbeat").send(String(a->heartbeat));
+  return true;
+}
+
+// Settings and statistics properties for aggregate A
+template <struct agg *A> static void aggAdvertise()
+{
+  HomieNode *node = A->node;
+
+  node->advertise("min").
+	setName("Window Minimum").
+	setDatatype("float");
+
+  node->advertise("max").
+	setName("Window Maximum").
+	setDatatype("float");
+
+  node->advertise("stddev").
+	setName("Window Standard Deviation").
+	setDatatype("float");
+
+  node->advertise("count").
+	setName("Window Sample Count").
+	setDatatype("integer");
+
+  node->advertise("publishes").
+	setName("Windows Published").
+	setDatatype("integer");
+
+  node->advertise("suppressed").
+	setName("Windows Inside Deadband").
+	setDatatype("integer");
+
+  node->advertise("window").
+	setName("Window Length").
+	setDatatype("integer").
+	setUnit("s").
+	settable([](const HomieRange& range, const String& value) { return aggWindowHandler(A, value); });
+
+  node->advertise("raw").
+	setName("Publish Every Sample").
+	setDatatype("boolean").
+	settable([](const HomieRange& range, const String& value) { return aggRawHandler(A, value); });
+
+  node->advertise("deadband").
+	setName("Deadband").
+	setDatatype("float").
+	settable([](const HomieRange& range, const String& value) { return aggDeadbandHandler(A, value); });
+
+  node->advertise("deadband-pct").
+	setName("Relative Deadband").
+	setDatatype("float").
+	setUnit("%").
+	settable([](const HomieRange& range, const String& value) { return aggDeadbandPctHandler(A, value); });
+
+  node->advertise("heartbeat").
+	setName("Heartbeat").
+	setDatatype("integer").
+	setUnit("s").
+	settable([](const HomieRange& range, const String& value) { return aggHeartbeatHandler(A, value); });
+}
+
+/*
+ * Sampling schedule.
+ *
+ * Each sensor is read every period seconds.  A sample that moved more
+ * than a deadband (see above) from the one before drops the period
+ * straight to sample-min, so lights going on are caught quickly.  One
+ * that moved more than a quarter deadband halves it, and one that
+ * didn't doubles it, up to sample-max.  Temperature and humidity come
+ * from the same read, so they share a schedule, set on the temp node.
+ *
+ * sample-rate is the average samples per hour since boot, to compare
+ * against what fixed periods would have cost.
+ */
+#define	LIGHT_PERIOD_MIN	3	// seconds
+#define	LIGHT_PERIOD_MAX	60
+#define	TH_PERIOD_MIN		10	// the DHT needs 2 s between reads
+#define	TH_PERIOD_MAX		600
+#define	PERIOD_LIMIT		3600
+
+struct sampler {
+  HomieNode *node;
+  long period;			// seconds, now
+  long min, max;		// bounds on period
+  long floor;			// lowest min the sensor allows
+  unsigned long samples;
+  bool changed;			// period not published yet
+};
+
+struct sampler light_sampler = {&luxNode, LIGHT_PERIOD_MIN, LIGHT_PERIOD_MIN, LIGHT_PERIOD_MAX, 1};
+struct sampler th_sampler = {&tempNode, TH_PERIOD_MIN, TH_PERIOD_MIN, TH_PERIOD_MAX, 3};
+
+// Pick the next period, given how far the last sample moved in deadbands
+static void sampleNext(struct sampler *s, float moved)
+{
+  long p;
+
+  s->samples++;
+  if (moved > 1.)
+    p = s->min;
+  else if (moved > 0.25)
+    p = s->period / 2;
+  else
+    p = s->period * 2;
+  if (p < s->min)
+    p = s->min;
+  if (p > s->max)
+    p = s->max;
+  if (p != s->period) {
+    s->period = p;
+    s->changed = true;
+  }
+}
+
+// Shortest or longest sampling period for s, in seconds
+static bool sampleBoundHandler(struct sampler *s, bool max, const String& value)
+{
+  long p;
+
+  for (unsigned j = 0; j < value.length(); j++)
+    if (!isDigit(value.charAt(j)))
+      return false;
+  p = value.toInt();
+  if (value.length() == 0 || p < s->floor || p > PERIOD_LIMIT ||
+      (max? p < s->min: p > s->max))
+    return false;
+
+  if (max)
+    s->max = p;
+  else
+    s->min = p;
+  if (s->period < s->min)
+    s->period = s->min;
+  if (s->period > s->max)
+    s->period = s->max;
+  s->changed = true;
+  s->node->setProperty(max? "sample-max": "sample-min").send(value);
+  return true;
+}
+
+// Samples per hour since boot
+static String sampleRate(struct sampler *s)
+{
+  unsigned long up = millis() / 1000;
+
+  return String(up? s->samples * 3600. / up: 0.);
+}
+
+// Schedule properties for sampler S
+template <struct sampler *S> static void sampleAdvertise()
+{
+  S->node->advertise("sample-period").
+	setName("Sampling Period").
+	setDatatype("integer").
+	setUnit("s");
+
+  S->node->advertise("sample-rate").
+	setName("Samples Per Hour").
+	setDatatype("float");
+
+  S->node->advertise("sample-min").
+	setName("Shortest Sampling Period").
+	setDatatype("integer").
+	setUnit("s").
+	settable([](const HomieRange& range, const String& value) { return sampleBoundHandler(S, false, value); });
+
+  S->node->advertise("sample-max").
+	setName("Longest Sampling Period").
+	setDatatype("integer").
+	setUnit("s").
+	settable([](const HomieRange& range, const String& value) { return sampleBoundHandler(S, true, value); });
+}
+
+/*
+ * Offline log.
+ *
+ * loopHandler() doesn't run while we're off the network, so closed
+ * windows are appended to a log in flash instead, and replayed to
+ * backfill/samples once we're back.  This device uses no EEPROM, so
+ * the log takes the EEPROM sector and the one below it, which
+ * eagle.flash.4m1m.ld leaves free between the file system and EEPROM
+ * (see platformio.ini).
+ *
+ * Every record has a sequence number, and record seq lives in slot
+ * seq % LOG_SLOTS of sector seq / LOG_SLOTS % LOG_SECTORS, so the two
+ * sectors make one ring and the order of the records never has to be
+ * worked out.  A free slot reads all ones.  Flash writes can only clear
+ * bits, so a record is marked sent by clearing its sent word in place.
+ * A sector is erased only when the log comes round to it again, which
+ * leaves the other sector's records alone; any of the erased ones not
+ * sent yet are counted as dropped.
+ * On boot both sectors are scanned, so an outage survives a reset.
+ *
+ * Windows closed before we've heard IOTtime can't be placed in time
+ * and aren't logged.
+ *
+ * The ESP8266 can't run code from flash while it's writing it, which
+ * holds off interrupts, so the log isn't touched while the DHT is
+ * sending.
+ */
+#define	LOG_BATCH	10	// records per backfill message
+#define	LOG_PERIOD	1000	// ms between backfill messages
+
+struct log_rec {
+  uint32_t seq;			// all ones if free
+  uint32_t end;			// IOTtime the window closed
+  uint32_t sent;		// all ones until backfilled
+  float mean, min, max;
+  uint16_t count;
+  uint8_t sensor;		// index in aggs[]
+  uint8_t check;		// of everything but sent
+};
+
+extern "C" uint32_t _EEPROM_start;
+#define	LOG_SECTOR(n)	(((uint32_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE - (n))
+#define	LOG_SECTORS	2
+#define	LOG_SLOTS	(SPI_FLASH_SEC_SIZE / sizeof (struct log_rec))
+#define	LOG_ADDR(seq)	(LOG_SECTOR((seq) / LOG_SLOTS % LOG_SECTORS) * SPI_FLASH_SEC_SIZE + \
+			 (seq) % LOG_SLOTS * sizeof (struct log_rec))
+
+uint32_t log_head;		// oldest record that may be unsent
+uint32_t log_tail;		// sequence number of the next record
+unsigned log_unsent;
+unsigned long log_dropped;
+unsigned long log_time;		// millis() of the last backfill message
+
+static uint8_t logCheck(const struct log_rec *rec)
+{
+  const uint8_t *p = (const uint8_t *)rec;
+  uint8_t h = 0x5a;
+
+  for (unsigned i = 0; i < sizeof *rec - 1; i++)
+    if (i < offsetof(struct log_rec, sent) || i >= offsetof(struct log_rec, mean))
+      h = (h << 1 | h >> 7) ^ p[i];
+  return h;
+}
+
+// Read record seq, and say whether it is there and still to be sent
+static bool logRead(uint32_t seq, struct log_rec *rec)
+{
+  ESP.flashRead(LOG_ADDR(seq), (uint32_t *)rec, sizeof *rec);
+  return rec->seq == seq && rec->sent != 0 && rec->check == logCheck(rec);
+}
+
+/*
+ * Find where we left off: the next record goes after the newest one,
+ * and the oldest unsent one is where backfill starts.  Slots past the
+ * newest record that aren't free were cut short by a reset, and are
+ * skipped.
+ */
+static void logScan()
+{
+  struct log_rec rec;
+  bool found = false;
+  unsigned n, i;
+
+  log_tail = 0;
+  for (n = 0; n < LOG_SECTORS; n++)
+    for (i = 0; i < LOG_SLOTS; i++) {
+      ESP.flashRead(LOG_SECTOR(n) * SPI_FLASH_SEC_SIZE + i * sizeof rec, (uint32_t *)&rec, sizeof rec);
+      if (rec.seq == 0xffffffff)
+        break;			// each sector is written in order, so the rest are free
+      if (rec.check != logCheck(&rec) || LOG_ADDR(rec.seq) != LOG_SECTOR(n) * SPI_FLASH_SEC_SIZE + i * sizeof rec)
+        continue;
+      if (!found || rec.seq >= log_tail) {
+        log_tail = rec.seq + 1;
+        found = true;
+      }
+    }
+  while (log_tail % LOG_SLOTS != 0) {
+    ESP.flashRead(LOG_ADDR(log_tail), (uint32_t *)&rec, sizeof rec);
+    if (rec.seq == 0xffffffff)
+      break;
+    log_tail++;
+  }
+
+  log_head = log_tail;
+  log_unsent = 0;
+  for (i = 0; i < LOG_SECTORS * LOG_SLOTS && i < log_tail; i++)
+    if (logRead(log_tail - 1 - i, &rec)) {
+      log_head = rec.seq;
+      log_unsent++;
+    }
+}
+
+// Log aggregate a's closed window, if we can
+static void logAppend(struct agg *a)
+{
+  struct log_rec rec;
+
+  a->ready = false;
+  if (!time_base || a->end <= time_base)
+    return;
+
+  // Come round to a sector: whatever is left in it is lost
+  if (log_tail % LOG_SLOTS == 0) {
+    for (uint32_t seq = log_head; seq + LOG_SECTORS * LOG_SLOTS < log_tail + LOG_SLOTS; seq++)
+      if (logRead(seq, &rec)) {
+        log_unsent--;
+        log_dropped++;
+      }
+    if (log_head + LOG_SECTORS * LOG_SLOTS < log_tail + LOG_SLOTS)
+      log_head = log_tail + LOG_SLOTS - LOG_SECTORS * LOG_SLOTS;
+    ESP.flashEraseSector(LOG_SECTOR(log_tail / LOG_SLOTS % LOG_SECTORS));
+  }
+  memset(&rec, 0xff, sizeof rec);
+  rec.seq = log_tail;
+  rec.end = a->end;
+  rec.mean = a->r_mean;
+  rec.min = a->r_min;
+  rec.max = a->r_max;
+  rec.count = a->r_n > 0xffff? 0xffff: a->r_n;
+  for (rec.sensor = 0; aggs[rec.sensor] != a; rec.sensor++)
+    ;
+  rec.check = logCheck(&rec);
+  ESP.flashWrite(LOG_ADDR(log_tail), (uint32_t *)&rec, sizeof rec);
+  log_tail++;
+  log_unsent++;
+}
+
+/*
+ * Called every loopHandler().  Sends up to LOG_BATCH records as one
+ * message, at most once every LOG_PERIOD, as
+ *	sensor,end,count,mean,min,max;...
+ */
+static void logBackfill()
+{
+  struct log_rec rec;
+  uint32_t sent[LOG_BATCH];
+  uint32_t i;
+  unsigned n;
+  String msg;
+
+  if (dht_state == DHT_READING)
+    return;
+  if (log_unsent == 0)
+    return;
+  if (millis() - log_time < LOG_PERIOD)
+    return;
+  log_time = millis();
+
+  n = 0;
+  for (i = log_head; i < log_tail && n < LOG_BATCH; i++) {
+    if (!logRead(i, &rec))
+      continue;
+    if (n > 0)
+      msg += ";";
+    msg += aggs[rec.sensor]->name;
+    msg += ",";
+    msg += String((unsigned long)rec.end);
+    msg += ",";
+    msg += String((unsigned)rec.count);
+    msg += ",";
+    msg += String(rec.mean);
+    msg += ",";
+    msg += String(rec.min);
+    msg += ",";
+    msg += String(rec.max);
+    sent[n++] = i;
+  }
+  if (n == 0 || backfillNode.setProperty("samples").setRetained(false).send(msg) == 0) {
+    if (n == 0) {
+      log_unsent = 0;		// they went bad in flash
+      log_head = log_tail;
+    }
+    return;
+  }
+
+  rec.sent = 0;
+  for (i = 0; i < n; i++)
+    ESP.flashWrite(LOG_ADDR(sent[i]) + offsetof(struct log_rec, sent), &rec.sent, sizeof rec.sent);
+  log_head = sent[n - 1] + 1;
+  log_unsent -= n;
+}
+
+#ifdef BATTERY
+/*
+ * Battery mode.
+ *
+ * Built with -D BATTERY (env:d1_battery, with D0 wired to RST), the
+ * device spends its time in deep sleep.  Each wake takes one light and
+ * one temp/humidity reading, adds them to a batch in RTC user memory,
+ * which survives deep sleep, and goes straight back to sleep with the
+ * radio never turned on.  Every SLEEP_CONNECT wakes it wakes with the
+ * radio on, connects, sends the batch as one backfill/samples message
+ * and the latest readings to the usual properties, and sleeps again.
+ * If the network isn't there in SLEEP_CONNECT_MS the batch waits for
+ * the next connection; a full batch loses its oldest readings.
+ *
+ * RTC memory also keeps the IOTtime we expect to wake at, so readings
+ * stay timestamped between connections.  The sleep timer drifts a
+ * little; the retained IOTtime broadcast puts that right each time we
+ * connect.  Until we've heard IOTtime once, every wake connects.
+ *
+ * Each reading keeps how long its wake was awake, from setup() to going
+ * back to sleep, sent in the batch as the "awake" series in ms.
+ */
+#define	SLEEP_PERIOD		300	// seconds between wakes
+#define	SLEEP_CONNECT		12	// wakes per connection
+#define	SLEEP_AWAKE_MS		10000	// give up on the sensors
+#define	SLEEP_CONNECT_MS	30000	// give up on the network
+#define	SLEEP_BATCH		30
+#define	SLEEP_MAGIC		0x534c5031
+#define	SLEEP_RTC_OFFSET	32	// in 4 byte blocks, clear of the boot loader's
+#define	SLEEP_NONE		-32768	// temp when the read failed
+
+struct sleep_sample {
+  uint32_t time;		// IOTtime of the reading, 0 if not known
+  uint16_t lux;
+  int16_t temp;			// tenths of a degree F
+  uint16_t humidity;		// tenths of a percent
+  uint16_t awake_ms;
+};
+
+struct sleep_state {
+  uint32_t magic;
+  uint32_t crc;			// FNV-1a over what follows
+  uint32_t clock;		// IOTtime at the next wake, 0 if not known
+  uint16_t wakes;		// since the last batch went out
+  uint16_t n;
+  struct sleep_sample batch[SLEEP_BATCH];
+};
+
+static_assert(sizeof (struct sleep_state) % 4 == 0, "RTC memory takes whole words");
+static_assert(SLEEP_RTC_OFFSET * 4 + sizeof (struct sleep_state) <= 512, "RTC user memory is 512 bytes");
+
+struct sleep_state sleep_buf;
+struct sleep_sample sleep_reading;	// this wake's
+bool sleep_connect;			// this wake connects
+bool sleep_sampled;			// sleep_reading is filled in
+bool sleep_sent;			// the batch went out
+
+static uint32_t sleepCrc(const struct sleep_state *ss)
+{
+  const unsigned char *p = (const unsigned char *)&ss->clock;
+  const unsigned char *end = (const unsigned char *)(ss + 1);
+  uint32_t h = 2166136261UL;
+
+  while (p < end) {
+    h ^= *p++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+// Does a wake after this many connect?
+static bool sleepConnects(const struct sleep_state *ss)
+{
+  return !ss->clock || ss->wakes % SLEEP_CONNECT == SLEEP_CONNECT - 1;
+}
+
+// Called from setup(): pick up where the last wake left off
+static void sleepRestore()
+{
+  ESP.rtcUserMemoryRead(SLEEP_RTC_OFFSET, (uint32_t *)&sleep_buf, sizeof sleep_buf);
+  if (sleep_buf.magic != SLEEP_MAGIC || sleep_buf.crc != sleepCrc(&sleep_buf)) {
+    memset(&sleep_buf, 0, sizeof sleep_buf);	// power on, or an OTA
+    sleep_buf.magic = SLEEP_MAGIC;
+  }
+  if (sleep_buf.clock)
+    time_base = sleep_buf.clock - millis()/1000;
+  sleep_connect = sleepConnects(&sleep_buf);
+
+  // read both sensors at once
+  last_light_time = time_base + millis()/1000 - PERIOD_LIMIT;
+  last_temp_time = last_light_time;
+}
+
+// Keep this wake's reading, and sleep until the next
+static void sleepNow()
+{
+  struct sleep_sample *ss;
+  RFMode rf;
+
+  if (sleep_sampled) {
+    if (sleep_buf.n == SLEEP_BATCH) {
+      memmove(sleep_buf.batch, sleep_buf.batch + 1, sizeof sleep_buf.batch[0] * (SLEEP_BATCH - 1));
+      sleep_buf.n--;
+    }
+    ss = &sleep_buf.batch[sleep_buf.n++];
+    *ss = sleep_reading;
+    ss->awake_ms = millis() > 0xffff? 0xffff: millis();
+  }
+  sleep_buf.wakes = sleep_sent? 0: sleep_buf.wakes + 1;
+  sleep_buf.clock = time_base? time_base + (millis() + 500)/1000 + SLEEP_PERIOD: 0;
+  sleep_buf.crc = sleepCrc(&sleep_buf);
+  ESP.rtcUserMemoryWrite(SLEEP_RTC_OFFSET, (uint32_t *)&sleep_buf, sizeof sleep_buf);
+
+  rf = sleepConnects(&sleep_buf)? WAKE_RF_DEFAULT: WAKE_RF_DISABLED;
+  if (sleep_connect)
+    Homie.doDeepSleep(SLEEP_PERIOD * 1000000ULL, rf);
+  else
+    ESP.deepSleep(SLEEP_PERIOD * 1000000ULL, rf);
+}
+
+// Called every loop() pass, instead of Homie.loop() on wakes that don't connect
+static void sleepLoop()
+{
+  if (!sleep_sampled && light_sampler.samples > 0 && (th_sampler.samples > 0 || dht_failures > 0)) {
+    sleep_sampled = true;
+    sleep_reading.time = time_base? now: 0;
+    sleep_reading.lux = light > 0xffff? 0xffff: light;
+    if (th_sampler.samples > 0) {
+      sleep_reading.temp = lrint(temp * 10.);
+      sleep_reading.humidity = lrint(humidity * 10.);
+    } else {
+      sleep_reading.temp = SLEEP_NONE;
+      sleep_reading.humidity = 0;
+    }
+  }
+
+  if (!sleep_connect) {
+    if (sleep_sampled || millis() >= SLEEP_AWAKE_MS)
+      sleepNow();
+    return;
+  }
+  Homie.loop();
+  if (millis() >= SLEEP_CONNECT_MS)
+    sleepNow();
+}
+
+// Add one reading of one series to the batch message
+static void sleepAppend(String& msg, const char *name, uint32_t t, String v)
+{
+  if (msg.length() > 0)
+    msg += ";";
+  msg += name;
+  msg += ",";
+  msg += String((unsigned long)t);
+  msg += ",1,";
+  msg += v;
+  msg += ",";
+  msg += v;
+  msg += ",";
+  msg += v;
+}
+
+/*
+ * Called every loopHandler() on wakes that connect.  Once we have this
+ * wake's reading and know the time, sends the batch in the offline log's
+ * format, and the reading to the sensor properties, then sleeps.
+ * Readings from before we first knew the time can't be placed, and are
+ * dropped.
+ */
+static void sleepPublish()
+{
+  struct sleep_sample *ss;
+  String msg;
+
+  if (sleep_sent || !sleep_sampled || !time_base)
+    return;
+  if (!sleep_reading.time)
+    sleep_reading.time = now;
+
+  for (ss = sleep_buf.batch; ss < sleep_buf.batch + sleep_buf.n; ss++) {
+    if (!ss->time)
+      continue;
+    sleepAppend(msg, "lux", ss->time, String((unsigned)ss->lux));
+    if (ss->temp != SLEEP_NONE) {
+      sleepAppend(msg, "temp", ss->time, String(ss->temp / 10.));
+      sleepAppend(msg, "humidity", ss->time, String(ss->humidity / 10.));
+    }
+    sleepAppend(msg, "awake", ss->time, String((unsigned)ss->awake_ms));
+  }
+  if (msg.length() > 0 && backfillNode.setProperty("samples").setRetained(false).send(msg) == 0)
+    return;
+
+  luxNode.setProperty("lux").send(String((unsigned)sleep_reading.lux));
+  luxNode.setProperty("time-last-update").send(String((unsigned long)sleep_reading.time));
+  if (sleep_reading.temp != SLEEP_NONE) {
+    tempNode.setProperty("temp").send(String(sleep_reading.temp / 10.));
+    tempNode.setProperty("time-last-update").send(String((unsigned long)sleep_reading.time));
+    humidityNode.setProperty("humidity").send(String(sleep_reading.humidity / 10.));
+    humidityNode.setProperty("time-last-update").send(String((unsigned long)sleep_reading.time));
+  }
+
+  sleep_buf.n = 0;
+  sleep_sent = true;
+  Homie.prepareToSleep();		// sleepNow() once we're off the broker
+}
+#endif
+
+void configureSensor(void)
+{
+  /*
+   * Gain and integration time are switched by processLight(), not by
+   * the library's auto-range, which waits out each integration in delay().
+   * The library is told too, as its lux calculation depends on them.
+   */
+  light_range = 0;
+  tsl.enableAutoRange(false);
+  tsl.setGain(light_ranges[light_range].gain);
+  tsl.setIntegrationTime(light_ranges[light_range].time);
+
+  Wire.setClock(400000);	// the TSL2561 does fast mode; the library left the bus up
+}
+
+/****
+ *
+ * Message Handlers
+ *
+ * NOTE: the message handlers are called asynchronously from the TCP/IP upcal.
+ * We assume this means they may be called from an interrupt at any time.
+ *
+ ****/
+
+// Broadcast handler.  Useful for time base.
+bool broadcastHandler(const String& level, const String& value) {
+  // Only broadcast we know about it IOTtime.
+  if (level == "IOTtime") {
+	long t = value.toInt();
+
+	if (t < 0) return false;
+
+	time_base = t - millis()/1000;
+	return true;
+  }
+  return false;
+}
+
+/*
+ * Homie events.  Every time we get back on the broker, whatever
+ * retained values it had may be stale, so the next window of each
+ * reading goes out whatever it is.
+ */
+void onHomieEvent(const HomieEvent& event) {
+  switch (event.type) {
+  case HomieEventType::MQTT_READY:
+    for (unsigned i = 0; i < N_AGGS; i++)
+      aggs[i]->published = false;
+    break;
+#ifdef BATTERY
+  case HomieEventType::READY_TO_SLEEP:
+    sleepNow();
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+/*
+ * This code called once to set up, but only after completely connected.
+ */
+void setupHandler() {
+  for (unsigned i = 0; i < N_AGGS; i++) {
+    aggs[i]->node->setProperty("window").send(String(aggs[i]->window));
+    aggs[i]->node->setProperty("raw").send(aggs[i]->raw? "true": "false");
+    aggs[i]->node->setProperty("deadband").send(String(aggs[i]->deadband));
+    aggs[i]->node->setProperty("deadband-pct").send(String(aggs[i]->deadband_pct));
+    aggs[i]->node->setProperty("heartbeat").send(String(aggs[i]->heartbeat));
+  }
+  luxNode.setProperty("unit").send("lux");
+  tempNode.setProperty("unit").send("F");
+  luxNode.setProperty("sample-min").send(String(light_sampler.min));
+  luxNode.setProperty("sample-max").send(String(light_sampler.max));
+  tempNode.setProperty("sample-min").send(String(th_sampler.min));
+  tempNode.setProperty("sample-max").send(String(th_sampler.max));
+  light_sampler.changed = true;
+  th_sampler.changed = true;
+}
+
+void setup() {
+  void loopHandler();
+  Serial.begin(115200);
+  Serial.println("Lux/Temp/RH sensors");
+  Serial.println(FIRMWARE_VERSION);
+  Serial << endl << endl;
+
+  configureSensor();
+  light = 0;
+  last_light_time = 0;
+  light_state = LIGHT_IDLE;
+  dht_state = DHT_IDLE;
+  pinMode(PIN_DHT, INPUT_PULLUP);
+  temp = 0.;
+  humidity = 0.;
+  last_temp_time = 0;
+
+  time_base = 0;
+  stats_time = millis();
+  logScan();
+  Homie.onEvent(onHomieEvent);
+#ifdef BATTERY
+  sleepRestore();
+  Homie.disableLedFeedback();
+#endif
+
+  Homie_setFirmware(FIRMWARE_NAME, FIRMWARE_VERSION);
+  Homie.setSetupFunction(setupHandler).setLoopFunction(loopHandler);
+
+  luxNode.advertise("lux").
+	setName("Light Intensity").
+	setDatatype("integer");
+
+  luxNode.advertise("unit").
+  	setName("Lux Unit").
+	setDatatype("string");
+
+  luxNode.advertise("time-last-update").
+	setName("Update Time").
+	setDatatype("integer");
+
+  tempNode.advertise("temp").
+	setName("Temperature").
+	setDatatype("integer");
+
+  tempNode.advertise("unit").
+	setName("Temp Unit").
+	setDatatype("string");
+
+  tempNode.advertise("time-last-update").
+	setName("Update Time").
+	setDatatype("integer");
+
+  humidityNode.advertise("humidity").
+	setName("Humidity").
+	setDatatype("integer");
+
+  humidityNode.advertise("time-last-update").
+	setName("Update Time").
+	setDatatype("integer");
+
+  aggAdvertise<&agg_lux>();
+  aggAdvertise<&agg_temp>();
+  aggAdvertise<&agg_humidity>();
+  sampleAdvertise<&light_sampler>();
+  sampleAdvertise<&th_sampler>();
+
+  statsNode.advertise("loop-histogram").
+	setName("Loop Time Histogram").
+	setDatatype("string");
+
+  statsNode.advertise("loop-max-us").
+	setName("Longest Loop").
+	setDatatype("integer");
+
+  statsNode.advertise("light-conversion-ms").
+	setName("Light Sample Time").
+	setDatatype("float").
+	setUnit("ms");
+
+  statsNode.advertise("light-i2c-bytes").
+	setName("Light I2C Bytes Per Sample").
+	setDatatype("float");
+
+  statsNode.advertise("dht-reads").
+	setName("Temp/RH Reads").
+	setDatatype("integer");
+
+  statsNode.advertise("dht-bad-checksum").
+	setName("Temp/RH Checksum Errors").
+	setDatatype("integer");
+
+  statsNode.advertise("dht-timeouts").
+	setName("Temp/RH Short Replies").
+	setDatatype("integer");
+
+  statsNode.advertise("dht-retries").
+	setName("Temp/RH Retries").
+	setDatatype("integer");
+
+  statsNode.advertise("dht-failures").
+	setName("Temp/RH Failed Samples").
+	setDatatype("integer");
+
+  statsNode.advertise("log-unsent").
+	setName("Offline Windows Not Yet Backfilled").
+	setDatatype("integer");
+
+  statsNode.advertise("log-dropped").
+	setName("Offline Windows Lost").
+	setDatatype("integer");
+
+  backfillNode.advertise("samples").
+	setName("Windows Logged While Offline").
+	setDatatype("string");
+
+  Homie.setBroadcastHandler(broadcastHandler);
+
+#ifdef BATTERY
+  if (sleep_connect)
+#endif
+  Homie.setup();
+}
+
+/*
+ * Light sensor registers.  The library reads the sensor only by powering
+ * it up, waiting out the integration in delay() and powering it down,
+ * so we talk to it directly; the library is still used to set it up and
+ * for its lux calculation.  Bytes are counted as they go on the wire,
+ * including the address byte of each transfer.
+ */
+static void tslWrite8(uint8_t reg, uint8_t value)
+{
+  Wire.beginTransmission(TSL2561_ADDR_FLOAT);
+  Wire.write(TSL2561_COMMAND_BIT | reg);
+  Wire.write(value);
+  Wire.endTransmission();
+  light_i2c_bytes += 3;
+}
+
+// A word read, with a repeated start rather than a stop between address and data
+static uint16_t tslRead16(uint8_t reg)
+{
+  uint16_t x;
+
+  Wire.beginTransmission(TSL2561_ADDR_FLOAT);
+  Wire.write(TSL2561_COMMAND_BIT | TSL2561_WORD_BIT | reg);
+  Wire.endTransmission(false);
+  Wire.requestFrom(TSL2561_ADDR_FLOAT, 2);
+  x = Wire.read();
+  x |= Wire.read() << 8;
+  light_i2c_bytes += 5;
+  return x;
+}
+
+// Power up, which starts an integration, and note when it will be done
+static void lightStart()
+{
+  tslWrite8(TSL2561_REGISTER_CONTROL, TSL2561_CONTROL_POWERON);
+  light_deadline = millis() + light_ranges[light_range].ms;
+  light_state = LIGHT_INTEGRATING;
+}
+
+/*
+ * Collect a finished integration.  Returns false if it was out of range,
+ * in which case the range has been switched and a new integration
+ * started.  Otherwise light is set and the sensor powered down.
+ * A light value of zero indicates sensor is overloaded.  No data.
+ *
+ * A sample that stays in range is four transactions: power up, read
+ * each channel, power down.  Switching range costs the library's six
+ * more, but only happens as the light changes.
+ */
+static bool lightCollect()
+{
+  uint16_t broadband, ir;
+  uint32_t lux;
+  unsigned char range = light_range;
+
+  broadband = tslRead16(TSL2561_REGISTER_CHAN0_LOW);
+  ir = tslRead16(TSL2561_REGISTER_CHAN1_LOW);
+
+  if (broadband < light_ranges[range].lo && range < N_LIGHT_RANGES - 1) {
+    range++;
+  } else if (broadband > light_ranges[range].hi && range > 0) {
+    range--;
+  } else {
+    tslWrite8(TSL2561_REGISTER_CONTROL, TSL2561_CONTROL_POWEROFF);
+    light_state = LIGHT_IDLE;
+    lux = tsl.calculateLux(broadband, ir);
+    light = lux >= 65536? 0: lux;
+    light_samples++;
+    light_ms += millis() - light_start;
+    return true;
+  }
+
+  // these power up, set the timing register and leave it powered down
+  if (light_ranges[range].gain != light_ranges[light_range].gain) {
+    tsl.setGain(light_ranges[range].gain);
+    light_i2c_bytes += 9;
+  }
+  if (light_ranges[range].time != light_ranges[light_range].time) {
+    tsl.setIntegrationTime(light_ranges[range].time);
+    light_i2c_bytes += 9;
+  }
+  light_range = range;
+  lightStart();
+  return false;
+}
+
+/*
+ * Falling edge on the DHT22 line.  Just note the time; loop() decodes.
+ */
+void IRAM_ATTR dhtIsr()
+{
+  if (dht_nedge < DHT_EDGES)
+    dht_edge[dht_nedge++] = micros();
+}
+
+/*
+ * Decode the reply the interrupt timed.  The sensor answers the start
+ * pulse with 80 us low, 80 us high, then 40 bits, each 50 us low and
+ * either 26 us (0) or 70 us (1) high, then a last 50 us low.  So the
+ * last 41 falling edges bound the 40 bits, and the time between two of
+ * them says what the bit was.  Bytes are humidity * 10, temperature * 10
+ * in C with the sign in the top bit, and a checksum.
+ * Returns true, with temp and humidity set, if the frame is good.
+ */
+static bool dhtDecode()
+{
+  unsigned char b[5];
+  unsigned char n = dht_nedge;
+  unsigned char i;
+  int t;
+
+  if (n < 41) {
+    dht_timeouts++;
+    return false;
+  }
+  memset(b, 0, sizeof b);
+  for (i = 0; i < 40; i++) {
+    unsigned long us = dht_edge[n - 40 + i] - dht_edge[n - 41 + i];
+
+    b[i / 8] = b[i / 8] << 1 | (us > DHT_ONE_US);
+  }
+  if ((unsigned char)(b[0] + b[1] + b[2] + b[3]) != b[4]) {
+    dht_bad_checksum++;
+    return false;
+  }
+
+  dht_reads++;
+  humidity = (b[0] << 8 | b[1]) / 10.;
+  t = (b[2] & 0x7f) << 8 | b[3];
+  if (b[2] & 0x80)
+    t = -t;
+  temp = t / 10. * 9. / 5. + 32.;		// in F
+  return true;
+}
+
+/*
+ * Called every loop() pass; never waits.  Starts an integration when a
+ * sample is due and collects it on the first pass after it is done.
+ * Returns true if we got a new sample.
+ */
+static bool processLight()
+{
+  switch (light_state) {
+  case LIGHT_IDLE:
+    if (now - last_light_time >= light_sampler.period) {
+      light_start = millis();
+      lightStart();
+    }
+    break;
+  case LIGHT_INTEGRATING:
+    if ((long)(millis() - light_deadline) >= 0 && lightCollect()) {
+      last_light_time = now;
+      sampleNext(&light_sampler, aggAdd(&agg_lux, light, now));
+      return true;
+    }
+    break;
+  }
+  return false;
+}
+
+/*
+ * Called every loop() pass; never waits.  A read goes:
+ *   pull the line low for DHT_START_MS to wake the sensor,
+ *   attach the interrupt and let the line go,
+ *   DHT_READ_MS later, take the interrupt off and decode what it timed.
+ * A bad read is tried again DHT_RETRY_MS later, up to DHT_RETRIES times.
+ * Temperature and humidity both come from the one frame.
+ */
+static void processTH()
+{
+  switch (dht_state) {
+  case DHT_IDLE:
+    if (now - last_temp_time < th_sampler.period)
+      break;
+    if (dht_tries > 0 && (long)(millis() - dht_deadline) < 0)
+      break;				// waiting to try again
+    pinMode(PIN_DHT, OUTPUT);
+    digitalWrite(PIN_DHT, LOW);
+    dht_deadline = millis() + DHT_START_MS;
+    dht_state = DHT_START;
+    break;
+  case DHT_START:
+    if ((long)(millis() - dht_deadline) < 0)
+      break;
+    dht_nedge = 0;
+    attachInterrupt(digitalPinToInterrupt(PIN_DHT), dhtIsr, FALLING);
+    pinMode(PIN_DHT, INPUT_PULLUP);	// a rising edge, so the interrupt doesn't see it
+    dht_deadline = millis() + DHT_READ_MS;
+    dht_state = DHT_READING;
+    break;
+  case DHT_READING:
+    if ((long)(millis() - dht_deadline) < 0)
+      break;
+    detachInterrupt(digitalPinToInterrupt(PIN_DHT));
+    dht_state = DHT_IDLE;
+    if (dhtDecode()) {
+      dht_tries = 0;
+      last_temp_time = now;
+      sampleNext(&th_sampler, fmax(aggAdd(&agg_temp, temp, now), aggAdd(&agg_humidity, humidity, now)));
+    } else if (dht_tries++ < DHT_RETRIES) {
+      dht_retries++;
+      dht_deadline = millis() + DHT_RETRY_MS;
+    } else {
+      dht_failures++;
+      dht_tries = 0;
+      last_temp_time = now;		// try again next period
+    }
+    break;
+  }
+}
+
+
+// Count one loop() pass of us microseconds
+static void loopTime(unsigned long us)
+{
+  int i;
+
+  for (i = 0; i < LOOP_BUCKETS - 1 && us >= loop_bucket_us[i]; i++)
+    ;
+  loop_hist[i]++;
+  if (us > loop_max_us)
+    loop_max_us = us;
+}
+
+// Publish the loop timing and start counting again
+static void publishStats()
+{
+  String h;
+  int i;
+
+  for (i = 0; i < LOOP_BUCKETS; i++) {
+    if (i)
+      h += ",";
+    h += String(loop_hist[i]);
+    loop_hist[i] = 0;
+  }
+  statsNode.setProperty("loop-histogram").send(h);
+  statsNode.setProperty("loop-max-us").send(String(loop_max_us));
+  loop_max_us = 0;
+
+  if (light_samples > 0) {
+    statsNode.setProperty("light-conversion-ms").send(String(light_ms / (float)light_samples));
+    statsNode.setProperty("light-i2c-bytes").send(String(light_i2c_bytes / (float)light_samples));
+  }
+  light_samples = 0;
+  light_ms = 0;
+  light_i2c_bytes = 0;
+
+  statsNode.setProperty("dht-reads").send(String(dht_reads));
+  statsNode.setProperty("dht-bad-checksum").send(String(dht_bad_checksum));
+  statsNode.setProperty("dht-timeouts").send(String(dht_timeouts));
+  statsNode.setProperty("dht-retries").send(String(dht_retries));
+  statsNode.setProperty("dht-failures").send(String(dht_failures));
+  luxNode.setProperty("sample-rate").send(sampleRate(&light_sampler));
+  tempNode.setProperty("sample-rate").send(sampleRate(&th_sampler));
+  statsNode.setProperty("log-unsent").send(String(log_unsent));
+  statsNode.setProperty("log-dropped").send(String(log_dropped));
+}
+
+/*
+ * This code is called once per loop(), but only
+ * when connected to WiFi and MQTT broker
+ */
+void loopHandler() {
+#ifdef BATTERY
+  sleepPublish();
+  return;
+#endif
+  if (millis() - stats_time >= STATS_PERIOD) {
+    stats_time = millis();
+    publishStats();
+  }
+
+  for (unsigned i = 0; i < N_AGGS; i++)
+    aggPublish(aggs[i]);
+  if (light_sampler.changed) {
+    light_sampler.changed = false;
+    luxNode.setProperty("sample-period").send(String(light_sampler.period));
+  }
+  if (th_sampler.changed) {
+    th_sampler.changed = false;
+    tempNode.setProperty("sample-period").send(String(th_sampler.period));
+  }
+  logBackfill();
+}
+
+/*
+ * This code runs repeatedly, whether connected to not.
+ */
+void loop() {
+  unsigned long start = micros();
+
+#ifdef maybe_a_bug
+  now = time_base + millis()/1000;
+#else
+  long t;
+
+  t = millis()/1000;
+  noInterrupts();
+  now = time_base + t;
+  interrupts();
+#endif
+
+
+  // Neither sensor ever waits
+  processLight();
+  processTH();
+#ifdef BATTERY
+  sleepLoop();
+#else
+  for (unsigned i = 0; i < N_AGGS; i++) {
+    aggTick(aggs[i], now);
+    if (aggs[i]->ready && !Homie.isConnected() && dht_state != DHT_READING)
+      logAppend(aggs[i]);
+  }
+  Homie.loop();
+#endif
+
+  loopTime(micros() - start);
+}
@@ -0,0 +1,90 @@
+/*
+ * Button capture.
+ *
+ * The interrupt timestamps each edge and debounces on those times:
+ * a level change is taken only if the last one taken is at least
+ * BTN_DEBOUNCE ms old.  Each press it takes goes into btn_ring for loop().
+ * A press either toggles the relay right there (BTN_TOGGLED) or is
+ * left for loopHandler() to report (BTN_REPORT).
+ *
+ * The includer supplies connected, PIN_RELAY and digitalWrite(), so
+ * the native test in test/test_button can run the capture on the host
+ * with no hardware: bounce, double presses and a full ring.
+ */
+#ifndef BUTTON_H
+#define BUTTON_H
+
+#ifndef IRAM_ATTR
+#define	IRAM_ATTR
+#endif
+
+#define	BTN_RING	8		// must be a power of 2
+#define	BTN_DEBOUNCE	25		// milliseconds
+
+#define	BTN_TOGGLED	0		// relay was toggled, level is its new state
+#define	BTN_REPORT	1		// press is to be reported through the button property
+
+struct btn_event {
+	unsigned long t;		// millis() at the edge
+	unsigned char what;		// BTN_TOGGLED or BTN_REPORT
+	bool level;			// relay state after the press
+};
+
+static struct btn_event btn_ring[BTN_RING];
+static volatile unsigned char btn_head;		// written only by the interrupt
+static volatile unsigned char btn_tail;		// written only by loop()
+static volatile bool relay_level;		// what is on the relay pin right now
+static volatile bool btn_pending;		// press waiting for loopHandler() to report
+static bool btn_level;				// debounced button level, interrupt only
+static unsigned long btn_last_edge;		// when btn_level last changed, interrupt only
+
+// One edge at time t.  Called from the interrupt.
+static void IRAM_ATTR btn_edge(unsigned long t, bool level)
+{
+	unsigned char head = btn_head;
+	struct btn_event *ev;
+	unsigned char what;
+
+	if (level == btn_level || t - btn_last_edge < BTN_DEBOUNCE)
+		return;
+	btn_level = level;
+	btn_last_edge = t;
+	if (!level)
+		return;
+
+	// Note that if we get two presses before
+	// Homie does anything with it, we assume we are not connected.
+	if (!connected || btn_pending) {
+		btn_pending = false;
+		relay_level = !relay_level;
+		digitalWrite(PIN_RELAY, relay_level? HIGH: LOW);
+		what = BTN_TOGGLED;
+	} else {
+		btn_pending = true;
+		what = BTN_REPORT;
+	}
+
+	// If loop() has fallen this far behind, it picks up the
+	// relay state from relay_level instead.  The slot at head is
+	// still the oldest unread event, so leave it alone.
+	if ((unsigned char)(head - btn_tail) >= BTN_RING)
+		return;
+	ev = &btn_ring[head & (BTN_RING - 1)];
+	ev->t = t;
+	ev->what = what;
+	ev->level = relay_level;
+	btn_head = head + 1;
+}
+
+static bool btn_get(struct btn_event *ev)
+{
+	unsigned char tail = btn_tail;
+
+	if (tail == btn_head)
+		return false;
+	*ev = btn_ring[tail & (BTN_RING - 1)];
+	btn_tail = tail + 1;
+	return true;
+}
+
+#endif
@@ -8,21 +8,43 @@
  *  A relay that controls two outlets.
  *  A Red LED that is hard wired to show the relay state.
  *
- * This version does not yet do anything with the button.
- *   Future versions will allow local control of output
- *   with the push button
+ * The button is watched by a pin change interrupt.  When we are not
+ *   connected, or a press has not been reported yet, the interrupt
+ *   toggles the relay itself, so local control works even while
+ *   the network code is busy.
+ *
+ * Relay on/off events can be scheduled two ways:
+ *   time-on / time-off set a single one-shot event each (IOTtime seconds)
+ *   schedule holds a table of up to SCHED_MAX entries, daily, weekly or one-shot.
+ *   All pending events live in one min-heap ordered by deadline, so loop()
+ *   only ever looks at the earliest one.
+ *
+ * Relay state, reason, time-on/time-off and the schedule table survive
+ * a reboot.  A copy is kept in RTC user memory, updated on every change,
+ * and a journal of copies is kept in the flash sector the EEPROM library
+ * would use and the one below it, written at most once a minute.
+ * setup() restores the relay from RTC memory after a reset, or from the
+ * newest journal entry after a power loss, before it starts on WiFi.
  *
  * The Blue LED has these modes:
  *   Powers up off.
  *   Turns on for 2 seconds when we connect to the WiFi and to the MQTT broker
  *   Blinks 50 ms on at 1 HZ when connected.
  *   Blinks 250 ms on at 1/5 HZ when not connected
+ *
+ * The mode property picks how loop() idles:
+ *   low-latency	loop() runs flat out, as it always has.
+ *   eco		loop() works out when it next has something to do
+ *			(schedule, LED, button) and sleeps until then, with
+ *			WiFi in light sleep.  Never longer than IDLE_MAX ms.
+ * Either way the relay and LED pins are only written when they change.
+ * loop-rate (passes per second) and idle (percent of time asleep)
+ * are published every STATS_PERIOD ms.
  */
-#include <Bounce2.h>
 #include <Homie.h>
 
 #define FIRMWARE_NAME     "outlet-control-WiOn"
-#define FIRMWARE_VERSION  "1.0.5"
+#define FIRMWARE_VERSION  "1.6.0"
 
 /*
  * Reason codes.
@@ -45,31 +67,144 @@ const int PIN_BUTTON = 13;
  */
 static bool on;			// state of the relay
 static const char * reason;	// one of the reason codes (above)
-static bool rising;		// true when we've detected a button push but have not yet done anything with it.
 static bool buttonState;	// set true by pressing button.  Set false by external entity.
 
 static long led_can_change;	// False when we are not to blink LED.  Mostly because some non-standard blinking going on.
+static int led_level;		// what is on the LED pin, -1 if unknown
+
+/*
+ * Idle control and loop statistics
+ */
+#define	MODE_LOW_LATENCY	0
+#define	MODE_ECO		1
+#define	IDLE_MAX		100		// longest eco sleep, milliseconds
+#define	STATS_PERIOD		60000		// milliseconds
+
+static unsigned char mode;
+static unsigned long stats_start;	// millis() the current period began
+static unsigned long stats_loops;	// loop() passes this period
+static unsigned long stats_idle_us;	// microseconds asleep this period
+static unsigned long loop_rate;		// last period's passes per second
+static unsigned long idle_pct;		// last period's percent of time asleep
 
 // only update properties when connected.
-// code that may run when not connected sets these variables to tell the
-// code that runs when we are connected to inform the world of a change
-static boolean connected;
-static boolean queued_reason;
-static boolean queued_ton;
-static boolean queued_toff;
-static boolean queued_time_last_change;
-static boolean queued_remote_set;
-static boolean desired_remote_set;
+// code that may run when not connected marks properties dirty to tell the
+// code that runs when we are connected to inform the world of a change.
+// Marking a property dirty twice before it is sent costs nothing; the
+// value is read when it is sent, so only the latest one goes out.
+// Follows the broker link through Homie events, so the button
+// interrupt sees it steady across Homie.loop().
+static volatile boolean connected;
+
+#define	PUB_ON			0x001
+#define	PUB_REASON		0x002
+#define	PUB_TIME_ON		0x004
+#define	PUB_TIME_OFF		0x008
+#define	PUB_TIME_LAST_CHANGE	0x010
+#define	PUB_SCHEDULE		0x020
+#define	PUB_SCHEDULE_NEXT	0x040
+#define	PUB_CMD_DROPPED		0x080
+#define	PUB_BUTTON		0x100
+#define	PUB_MODE		0x200
+#define	PUB_LOOP_RATE		0x400
+#define	PUB_IDLE		0x800
+#define	PUB_N			12
+#define	PUB_ALL			((1 << PUB_N) - 1)
+#define	PUB_PER_PASS		2	// most properties sent per loopHandler() pass
+
+static unsigned int pub_dirty;
+#define	pub_mark(bits)	(pub_dirty |= (bits))
+
+// Set when anything that survives a reboot changes
+static boolean persist_dirty;
+#define	persist_mark()	(persist_dirty = true)
 
 // Schedule stuff
 long	time_to_turn_on;	// set to zero if not in use
 long	time_to_turn_off;	// set to zero if not in use
 long	time_base;		// Current time is time_base + millis()/1000
-long	queued_time_base;	// push set of time base out of ISR
 long	time_last_change;	// When did we last change?
 
-// Debounce the input button
-Bounce debouncer = Bounce(); // Instantiate a Bounce object
+/*
+ * Schedule table.
+ *
+ * Slot 0 holds the time-on event, slot 1 the time-off event, the rest
+ * hold entries set through the "schedule" property.
+ * Times are IOTtime: seconds since midnight, Nov 1 2018, local time.
+ *
+ * Schedule property syntax, entries separated by space, comma or semicolon:
+ *   HH:MM=on		every day
+ *   D/HH:MM=off	every week, D is 0 (Sunday) through 6 (Saturday)
+ *   @T=on		once, at IOTtime T, up to SCHED_AT_MAX (about 2035)
+ * An empty value or "none" clears the table.
+ */
+#define	SCHED_MAX	32		// entries settable through the schedule property
+#define	SCHED_TON	0		// slot used by time-on
+#define	SCHED_TOFF	1		// slot used by time-off
+#define	SCHED_FIRST	2		// first slot used by the schedule table
+#define	SCHED_SLOTS	(SCHED_FIRST + SCHED_MAX)
+
+#define	SCHED_ONCE	0		// fire once at an absolute time
+#define	SCHED_DAILY	1		// fire every day at a time of day
+#define	SCHED_WEEKLY	2		// fire every week at a time of week
+#define	SCHED_AT_MAX	0x1fffffffL	// at is kept in 29 bits across a reboot
+
+#define	SCHED_DAY	86400L
+#define	SCHED_WEEK	(7 * SCHED_DAY)
+#define	SCHED_EPOCH_DOW	4		// Nov 1 2018 was a Thursday
+#define	SCHED_SLEW	60		// time base jumps bigger than this re-anchor the schedule
+
+struct sched_entry {
+	long when;		// next time this entry fires
+	long at;		// ONCE: IOTtime.  DAILY: second of day.  WEEKLY: second of week (Sunday based)
+	unsigned char kind;	// SCHED_ONCE, SCHED_DAILY, SCHED_WEEKLY
+	bool action;		// relay state to set
+};
+
+static struct sched_entry sched[SCHED_SLOTS];
+static unsigned char sched_heap[SCHED_SLOTS];	// slot numbers, min-heap on sched[].when
+static unsigned char sched_pos[SCHED_SLOTS];	// where each slot sits in the heap
+static unsigned char sched_n;			// entries in the heap
+static unsigned char sched_count;		// entries in the schedule table
+#define	SCHED_NOT_QUEUED	0xff
+
+// The handler parses into a staging table, loop() installs it.
+// The handler owns it while sched_staged_busy is false, loop() while it is true.
+static struct sched_entry sched_staged[SCHED_MAX];
+static unsigned char sched_staged_count;
+static volatile boolean sched_staged_busy;
+
+/*
+ * Command queue.
+ *
+ * The message handlers are the only producer, loop() is the only consumer.
+ * Each handler appends one fixed size record; loop() drains them in order.
+ * Nothing here allocates.  If the ring is full the command is dropped
+ * and counted, and the handler reports the message as not handled.
+ */
+#define	CMD_RING	16		// must be a power of 2
+
+#define	CMD_TIME_BASE	0		// arg: IOTtime at millis() == 0
+#define	CMD_ON		1		// arg: desired relay state
+#define	CMD_TIME_ON	2		// arg: IOTtime, 0 to cancel
+#define	CMD_TIME_OFF	3		// arg: IOTtime, 0 to cancel
+#define	CMD_SCHEDULE	4		// arg: unused, table is in sched_staged[]
+#define	CMD_BUTTON	5		// arg: new button state
+#define	CMD_MODE	6		// arg: MODE_LOW_LATENCY or MODE_ECO
+
+struct outlet_cmd {
+	long arg;
+	unsigned char kind;
+};
+
+static struct outlet_cmd cmd_ring[CMD_RING];
+static volatile unsigned char cmd_head;		// written only by producer
+static volatile unsigned char cmd_tail;		// written only by consumer
+static volatile unsigned long cmd_dropped;	// written only by producer
+static unsigned long cmd_dropped_published;
+
+// Button capture, up to handing presses to loop()
+#include "button.h"
 
 // This node is controls the relay
 HomieNode outletNode("outlet", "outlet", "relay");
@@ -86,14 +221,726 @@ static char *l_to_s(long i)
 	return buf;
 }
 
+/****
+ *
+ * Schedule engine
+ *
+ ****/
+
+// Next time a recurring entry fires, strictly after now.
+static long sched_next(const struct sched_entry *e, long now)
+{
+	long base, next;
+
+	switch (e->kind) {
+	case SCHED_DAILY:
+		base = now - now % SCHED_DAY;
+		next = base + e->at;
+		if (next <= now)
+			next += SCHED_DAY;
+		return next;
+	case SCHED_WEEKLY:
+		base = now - now % SCHED_DAY;
+		base -= ((now / SCHED_DAY + SCHED_EPOCH_DOW) % 7) * SCHED_DAY;
+		next = base + e->at;
+		if (next <= now)
+			next += SCHED_WEEK;
+		return next;
+	}
+	return e->at;
+}
+
+static void sched_swap(unsigned char a, unsigned char b)
+{
+	unsigned char t;
+
+	t = sched_heap[a];
+	sched_heap[a] = sched_heap[b];
+	sched_heap[b] = t;
+	sched_pos[sched_heap[a]] = a;
+	sched_pos[sched_heap[b]] = b;
+}
+
+static void sched_up(unsigned char k)
+{
+	while (k > 0) {
+		unsigned char parent = (k - 1) / 2;
+
+		if (sched[sched_heap[parent]].when <= sched[sched_heap[k]].when)
+			break;
+		sched_swap(k, parent);
+		k = parent;
+	}
+}
+
+static void sched_down(unsigned char k)
+{
+	for (;;) {
+		unsigned char c = 2 * k + 1;
+
+		if (c >= sched_n)
+			break;
+		if (c + 1 < sched_n && sched[sched_heap[c + 1]].when < sched[sched_heap[c]].when)
+			c++;
+		if (sched[sched_heap[k]].when <= sched[sched_heap[c]].when)
+			break;
+		sched_swap(k, c);
+		k = c;
+	}
+}
+
+static void sched_insert(unsigned char slot)
+{
+	sched_heap[sched_n] = slot;
+	sched_pos[slot] = sched_n;
+	sched_n++;
+	sched_up(sched_n - 1);
+}
+
+static void sched_remove(unsigned char slot)
+{
+	unsigned char k = sched_pos[slot];
+
+	if (k == SCHED_NOT_QUEUED)
+		return;
+	sched_pos[slot] = SCHED_NOT_QUEUED;
+	sched_n--;
+	if (k == sched_n)
+		return;
+	sched_heap[k] = sched_heap[sched_n];
+	sched_pos[sched_heap[k]] = k;
+	sched_up(k);
+	sched_down(sched_pos[sched_heap[k]]);
+}
+
+// (Re)queue a one-shot slot.  A time of zero means not in use.
+static void sched_set_once(unsigned char slot, long t, bool action)
+{
+	sched_remove(slot);
+	pub_mark(PUB_SCHEDULE_NEXT);
+	persist_mark();
+	if (t == 0)
+		return;
+	sched[slot].kind = SCHED_ONCE;
+	sched[slot].at = t;
+	sched[slot].when = t;
+	sched[slot].action = action;
+	sched_insert(slot);
+}
+
+/*
+ * Rebuild the heap from scratch.
+ * Recurring entries can only be placed once we know what time it is,
+ * so until the time base arrives only one-shot entries are queued.
+ */
+static void sched_rebuild(long now)
+{
+	unsigned char i;
+
+	sched_n = 0;
+	for (i = 0; i < SCHED_SLOTS; i++)
+		sched_pos[i] = SCHED_NOT_QUEUED;
+
+	if (time_to_turn_on)
+		sched_set_once(SCHED_TON, time_to_turn_on, true);
+	if (time_to_turn_off)
+		sched_set_once(SCHED_TOFF, time_to_turn_off, false);
+
+	for (i = SCHED_FIRST; i < SCHED_FIRST + sched_count; i++) {
+		if (sched[i].kind != SCHED_ONCE) {
+			if (!time_base)
+				continue;
+			sched[i].when = sched_next(&sched[i], now);
+		} else
+			sched[i].when = sched[i].at;
+		sched_insert(i);
+	}
+	pub_mark(PUB_SCHEDULE_NEXT);
+}
+
+/*
+ * Parse a schedule property value into sched_staged[].
+ * Returns false, leaving the current table alone, on any syntax error.
+ */
+static bool sched_parse(const char *p)
+{
+	unsigned char n = 0;
+
+	if (strcmp(p, "none") == 0)
+		p = "";
+
+	for (;;) {
+		struct sched_entry e;
+		long v;
+
+		while (*p == ' ' || *p == ',' || *p == ';')
+			p++;
+		if (*p == '\0')
+			break;
+		if (n >= SCHED_MAX)
+			return false;
+
+		if (*p == '@') {
+			p++;
+			if (!isDigit(*p))
+				return false;
+			for (v = 0; isDigit(*p); p++) {
+				v = v * 10 + (*p - '0');
+				if (v > SCHED_AT_MAX)
+					return false;
+			}
+			if (v <= 0)
+				return false;
+			e.kind = SCHED_ONCE;
+			e.at = v;
+		} else {
+			long hh, mm;
+
+			e.kind = SCHED_DAILY;
+			e.at = 0;
+			if (isDigit(p[0]) && p[1] == '/') {
+				if (p[0] > '6')
+					return false;
+				e.kind = SCHED_WEEKLY;
+				e.at = (p[0] - '0') * SCHED_DAY;
+				p += 2;
+			}
+			if (!isDigit(*p))
+				return false;
+			for (hh = 0; isDigit(*p); p++)
+				hh = hh * 10 + (*p - '0');
+			if (*p++ != ':' || !isDigit(p[0]) || !isDigit(p[1]))
+				return false;
+			mm = (p[0] - '0') * 10 + (p[1] - '0');
+			p += 2;
+			if (hh > 23 || mm > 59)
+				return false;
+			e.at += hh * 3600 + mm * 60;
+		}
+
+		if (*p++ != '=')
+			return false;
+		if (strncmp(p, "on", 2) == 0) {
+			e.action = true;
+			p += 2;
+		} else if (strncmp(p, "off", 3) == 0) {
+			e.action = false;
+			p += 3;
+		} else
+			return false;
+		if (*p != '\0' && *p != ' ' && *p != ',' && *p != ';')
+			return false;
+
+		e.when = 0;
+		sched_staged[n++] = e;
+	}
+	sched_staged_count = n;
+	return true;
+}
+
+// Canonical text form of the schedule table, for echoing back.
+static const char *sched_text()
+{
+	static char buf[SCHED_MAX * 16 + 1];
+	char *p = buf;
+	unsigned char i;
+
+	for (i = SCHED_FIRST; i < SCHED_FIRST + sched_count; i++) {
+		const struct sched_entry *e = &sched[i];
+		long tod;
+
+		if (p != buf)
+			*p++ = ' ';
+		if (e->kind == SCHED_ONCE) {
+			*p++ = '@';
+			ltoa(e->at, p, 10);
+			p += strlen(p);
+		} else {
+			tod = e->at % SCHED_DAY;
+			if (e->kind == SCHED_WEEKLY) {
+				*p++ = '0' + e->at / SCHED_DAY;
+				*p++ = '/';
+			}
+			*p++ = '0' + tod / 36000;
+			*p++ = '0' + tod / 3600 % 10;
+			*p++ = ':';
+			*p++ = '0' + tod / 600 % 6;
+			*p++ = '0' + tod / 60 % 10;
+		}
+		strcpy(p, e->action ? "=on" : "=off");
+		p += strlen(p);
+	}
+	*p = '\0';
+	return (p == buf)? "none": buf;
+}
+
+// The next pending event, as "@T=on", or "none"
+static const char *sched_next_text()
+{
+	static char buf[24];
+	const struct sched_entry *e;
+
+	if (sched_n == 0)
+		return "none";
+	e = &sched[sched_heap[0]];
+	buf[0] = '@';
+	ltoa(e->when, buf + 1, 10);
+	strcat(buf, e->action ? "=on" : "=off");
+	return buf;
+}
+
+static void relay_change(bool state, const char *why, long now)
+{
+	on = state;
+	reason = why;
+	time_last_change = now;
+	pub_mark(PUB_ON | PUB_REASON | PUB_TIME_LAST_CHANGE);
+	persist_mark();
+}
+
+/*
+ * Fire the earliest event.  Caller has checked it is due.
+ * One-shot entries leave the heap, recurring entries move to their next time.
+ */
+static void sched_fire(long now)
+{
+	unsigned char slot = sched_heap[0];
+	struct sched_entry *e = &sched[slot];
+
+	if (on != e->action)
+		relay_change(e->action, REASON_TIME, now);
+
+	if (e->kind == SCHED_ONCE) {
+		sched_remove(slot);
+		if (slot == SCHED_TON) {
+			time_to_turn_on = 0;
+			pub_mark(PUB_TIME_ON);
+		} else if (slot == SCHED_TOFF) {
+			time_to_turn_off = 0;
+			pub_mark(PUB_TIME_OFF);
+		} else {
+			// Drop it from the table so a rebuild does not fire it again
+			for (; slot < SCHED_FIRST + sched_count - 1; slot++)
+				sched[slot] = sched[slot + 1];
+			sched_count--;
+			sched_rebuild(now);
+			pub_mark(PUB_SCHEDULE);
+		}
+		persist_mark();
+	} else {
+		e->when = sched_next(e, now);
+		sched_down(0);
+	}
+	pub_mark(PUB_SCHEDULE_NEXT);
+}
+
+/****
+ *
+ * Persistent state
+ *
+ * One persist_state record holds everything we restore at boot.
+ * RTC user memory keeps one copy; Homie uses a few blocks near the
+ * start of it, so ours starts at PERSIST_RTC_OFFSET.  The flash journal
+ * appends copies to one of two sectors.  When that one is full the
+ * other is erased and the journal moves there, so the newest record
+ * is still in flash while the erase runs.  The second sector is the
+ * one below the EEPROM sector; eagle.flash.1m60.ld keeps the file
+ * system out of it.
+ *
+ ****/
+
+#define	PERSIST_MAGIC		0x4f55544cUL	// "OUTL"
+#define	PERSIST_RTC_OFFSET	32		// in 4 byte blocks
+#define	PERSIST_RTC_PERIOD	10000		// refresh the RTC copy (and its clock) this often, ms
+#define	PERSIST_FLASH_BATCH	60000		// at most one flash write this often, ms
+
+struct persist_state {
+	uint32_t magic;
+	uint32_t seq;			// journal sequence number
+	uint32_t crc;			// FNV-1a over the rest of the record
+	int32_t now;			// IOTtime when written, 0 if unknown.  Only trusted from RTC memory.
+	int32_t time_last_change;
+	int32_t time_to_turn_on;
+	int32_t time_to_turn_off;
+	uint8_t on;
+	uint8_t reason;			// index into persist_reasons[]
+	uint8_t sched_count;
+	uint8_t pad;
+	uint32_t sched[SCHED_MAX];	// kind << 30 | action << 29 | at
+};
+
+static const char *persist_reasons[] = {
+	REASON_BOOT,
+	REASON_LOCAL,
+	REASON_REMOTE,
+	REASON_TIME,
+};
+#define	PERSIST_REASONS	(sizeof persist_reasons / sizeof persist_reasons[0])
+
+extern "C" uint32_t _EEPROM_start;
+#define	PERSIST_SECTOR(n)	(((uint32_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE - (n))
+#define	PERSIST_SECTORS	2
+#define	PERSIST_SLOTS	(SPI_FLASH_SEC_SIZE / sizeof (struct persist_state))
+
+static struct persist_state persist_buf;	// scratch record, 4 byte aligned for flash
+static unsigned char persist_sector;		// journal sector being appended to
+static unsigned char persist_slot;		// next free slot in it
+static uint32_t persist_seq;			// sequence number of the newest journal record
+static uint32_t persist_flash_crc;		// crc of the newest journal record
+static boolean persist_flash_pending;		// a change has not reached flash yet
+static unsigned long persist_rtc_time;		// millis() of the last RTC write
+static unsigned long persist_flash_time;	// millis() of the last flash write
+
+static uint32_t persist_crc(const struct persist_state *ps)
+{
+	const unsigned char *p = (const unsigned char *)&ps->now;
+	const unsigned char *end = (const unsigned char *)(ps + 1);
+	uint32_t h = 2166136261UL;
+
+	while (p < end) {
+		h ^= *p++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static bool persist_valid(const struct persist_state *ps)
+{
+	return ps->magic == PERSIST_MAGIC &&
+		ps->sched_count <= SCHED_MAX &&
+		ps->reason < PERSIST_REASONS &&
+		ps->crc == persist_crc(ps);
+}
+
+static void persist_fill(struct persist_state *ps, long now)
+{
+	unsigned char i;
+
+	memset(ps, 0, sizeof *ps);
+	ps->magic = PERSIST_MAGIC;
+	ps->now = time_base? now: 0;
+	ps->time_last_change = time_last_change;
+	ps->time_to_turn_on = time_to_turn_on;
+	ps->time_to_turn_off = time_to_turn_off;
+	ps->on = on;
+	for (i = 0; i < PERSIST_REASONS && persist_reasons[i] != reason; i++)
+		;
+	ps->reason = (i < PERSIST_REASONS)? i: 0;	// not in the table: restore as boot
+	ps->sched_count = sched_count;
+	for (i = 0; i < sched_count; i++) {
+		const struct sched_entry *e = &sched[SCHED_FIRST + i];
+
+		ps->sched[i] = (uint32_t)e->kind << 30 | (uint32_t)e->action << 29 | e->at;
+	}
+	ps->crc = persist_crc(ps);
+}
+
+static void persist_apply(const struct persist_state *ps)
+{
+	unsigned char i;
+
+	if (ps->now)
+		time_base = ps->now - millis()/1000;
+	time_last_change = ps->time_last_change;
+	time_to_turn_on = ps->time_to_turn_on;
+	time_to_turn_off = ps->time_to_turn_off;
+	on = ps->on;
+	reason = persist_reasons[ps->reason];
+	sched_count = ps->sched_count;
+	for (i = 0; i < sched_count; i++) {
+		struct sched_entry *e = &sched[SCHED_FIRST + i];
+
+		e->kind = ps->sched[i] >> 30;
+		e->action = (ps->sched[i] >> 29) & 1;
+		e->at = ps->sched[i] & SCHED_AT_MAX;
+		e->when = 0;
+	}
+}
+
+/*
+ * Find the newest journal record, and where the next one goes: after
+ * the newest record, in its sector.
+ * Returns true, with the record in persist_buf, if there is one.
+ */
+static bool persist_scan()
+{
+	struct persist_state best;
+	unsigned char free_slot[PERSIST_SECTORS];
+	bool found = false;
+	unsigned char n, i;
+
+	persist_seq = 0;
+	persist_sector = 0;
+	for (n = 0; n < PERSIST_SECTORS; n++) {
+		uint32_t addr = PERSIST_SECTOR(n) * SPI_FLASH_SEC_SIZE;
+
+		free_slot[n] = PERSIST_SLOTS;
+		for (i = 0; i < PERSIST_SLOTS; i++) {
+			ESP.flashRead(addr + i * sizeof persist_buf, (uint32_t *)&persist_buf, sizeof persist_buf);
+			if (persist_buf.magic == 0xffffffffUL) {
+				free_slot[n] = i;	// each sector is written in order, so the rest are empty
+				break;
+			}
+			if (persist_valid(&persist_buf) && (!found || persist_buf.seq > best.seq)) {
+				best = persist_buf;
+				persist_sector = n;
+				found = true;
+			}
+		}
+	}
+	persist_slot = free_slot[persist_sector];
+	if (found) {
+		persist_buf = best;
+		persist_seq = best.seq;
+		persist_flash_crc = best.crc;
+	}
+	return found;
+}
+
+static void persist_flash_write()
+{
+	if (persist_slot >= PERSIST_SLOTS) {
+		persist_sector = (persist_sector + 1) % PERSIST_SECTORS;
+		ESP.flashEraseSector(PERSIST_SECTOR(persist_sector));
+		persist_slot = 0;
+	}
+	persist_buf.seq = ++persist_seq;
+	ESP.flashWrite(PERSIST_SECTOR(persist_sector) * SPI_FLASH_SEC_SIZE + persist_slot * sizeof persist_buf,
+		(uint32_t *)&persist_buf, sizeof persist_buf);
+	persist_slot++;
+	persist_flash_crc = persist_buf.crc;
+}
+
+/*
+ * Called from setup() before anything else.  RTC memory wins if it is
+ * valid, since it survives only a reset and is always current.
+ * Otherwise take the newest journal record, without its clock.
+ */
+static void persist_restore()
+{
+	bool from_rtc;
+
+	ESP.rtcUserMemoryRead(PERSIST_RTC_OFFSET, (uint32_t *)&persist_buf, sizeof persist_buf);
+	from_rtc = persist_valid(&persist_buf);
+	if (from_rtc) {
+		struct persist_state rtc = persist_buf;
+
+		persist_scan();
+		persist_buf = rtc;
+	} else if (persist_scan()) {
+		persist_buf.now = 0;
+	} else
+		return;
+	persist_apply(&persist_buf);
+}
+
+/*
+ * Called once per loop() pass.  RTC memory is cheap, so it is rewritten on
+ * every change and every PERSIST_RTC_PERIOD to keep its clock fresh.
+ * Flash changes are batched to one write per PERSIST_FLASH_BATCH, and
+ * skipped if we have come back to what flash already holds.
+ */
+static void persist_flush(unsigned long t, long now)
+{
+	if (persist_dirty || t - persist_rtc_time >= PERSIST_RTC_PERIOD) {
+		persist_fill(&persist_buf, now);
+		ESP.rtcUserMemoryWrite(PERSIST_RTC_OFFSET, (uint32_t *)&persist_buf, sizeof persist_buf);
+		persist_rtc_time = t;
+		if (persist_dirty) {
+			persist_dirty = false;
+			persist_flash_pending = true;
+		}
+	}
+
+	if (persist_flash_pending && t - persist_flash_time >= PERSIST_FLASH_BATCH) {
+		persist_flash_pending = false;
+		persist_fill(&persist_buf, 0);
+		if (persist_buf.crc != persist_flash_crc) {
+			persist_flash_write();
+			persist_flash_time = t;
+		}
+	}
+}
+
+/****
+ *
+ * Publish engine
+ *
+ * Each property has a dirty bit in pub_dirty.  loopHandler() sends at
+ * most PUB_PER_PASS of them per pass, going round the bits from where
+ * the last pass stopped, so properties that keep changing can't hold
+ * back the ones after them.  A hash of the last value the broker
+ * acknowledged is kept for each property; a dirty property whose
+ * value matches it is not sent again.  After a reconnect everything is
+ * marked dirty, so only properties that changed while we were away go out.
+ *
+ ****/
+
+static const char *pub_on() { return on? "true": "false"; }
+static const char *pub_reason() { return reason; }
+static const char *pub_time_on() { return l_to_s(time_to_turn_on); }
+static const char *pub_time_off() { return l_to_s(time_to_turn_off); }
+static const char *pub_time_last_change() { return time_base > 0? l_to_s(time_last_change): NULL; }
+static const char *pub_cmd_dropped() { return l_to_s(cmd_dropped_published); }
+static const char *pub_button() { return buttonState? "true": "false"; }
+static const char *pub_mode() { return mode == MODE_ECO? "eco": "low-latency"; }
+static const char *pub_loop_rate() { return l_to_s(loop_rate); }
+static const char *pub_idle() { return l_to_s(idle_pct); }
+
+struct pub_prop {
+	HomieNode *node;
+	const char *name;
+	const char *(*value)();		// NULL return means nothing to publish
+};
+
+// In PUB_ bit order
+static const struct pub_prop pub_props[PUB_N] = {
+	{&outletNode, "on", pub_on},
+	{&outletNode, "reason", pub_reason},
+	{&outletNode, "time-on", pub_time_on},
+	{&outletNode, "time-off", pub_time_off},
+	{&outletNode, "time-last-change", pub_time_last_change},
+	{&outletNode, "schedule", sched_text},
+	{&outletNode, "schedule-next", sched_next_text},
+	{&outletNode, "cmd-dropped", pub_cmd_dropped},
+	{&buttonNode, "button", pub_button},
+	{&outletNode, "mode", pub_mode},
+	{&outletNode, "loop-rate", pub_loop_rate},
+	{&outletNode, "idle", pub_idle},
+};
+
+static uint32_t pub_acked[PUB_N];	// hash of the value the broker has
+static uint32_t pub_sent[PUB_N];	// hash of the value in flight
+static uint16_t pub_packet[PUB_N];	// packet id in flight, 0 if none
+static volatile boolean pub_resync;	// set on (re)connect
+static unsigned char pub_next;		// bit the next pass looks at first
+
+// FNV-1a
+static uint32_t pub_hash(const char *p)
+{
+	uint32_t h = 2166136261UL;
+
+	while (*p) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static void pub_flush()
+{
+	unsigned char n, i, sent;
+
+	if (pub_resync) {
+		pub_resync = false;
+		for (i = 0; i < PUB_N; i++)
+			pub_packet[i] = 0;
+		pub_mark(PUB_ALL);
+	}
+
+	sent = 0;
+	for (n = 0; n < PUB_N && pub_dirty && sent < PUB_PER_PASS; n++) {
+		unsigned int bit;
+		const char *v;
+		uint32_t h;
+		uint16_t id;
+
+		i = (pub_next + n) % PUB_N;
+		bit = 1 << i;
+		if (!(pub_dirty & bit))
+			continue;
+		pub_dirty &= ~bit;
+		v = pub_props[i].value();
+		if (v == NULL)
+			continue;
+
+		// Broker already has it, or it is on its way
+		h = pub_hash(v);
+		if (h == pub_acked[i] || (pub_packet[i] && h == pub_sent[i]))
+			continue;
+
+		id = pub_props[i].node->setProperty(pub_props[i].name).send(v);
+		if (id == 0) {
+			pub_mark(bit);		// try again next pass, first
+			pub_next = i;
+			break;
+		}
+		pub_sent[i] = h;
+		pub_packet[i] = id;
+		sent++;
+		pub_next = (i + 1) % PUB_N;
+	}
+}
+
+/****
+ *
+ * Command queue
+ *
+ ****/
+
+// Producer side.  Called only from the message handlers.
+static bool cmd_put(unsigned char kind, long arg)
+{
+	unsigned char head = cmd_head;
+
+	if ((unsigned char)(head - cmd_tail) >= CMD_RING) {
+		cmd_dropped = cmd_dropped + 1;
+		return false;
+	}
+	cmd_ring[head & (CMD_RING - 1)].kind = kind;
+	cmd_ring[head & (CMD_RING - 1)].arg = arg;
+	__sync_synchronize();		// record is complete before it is visible
+	cmd_head = head + 1;
+	return true;
+}
+
+// Consumer side.  Called only from loop().
+static bool cmd_get(struct outlet_cmd *c)
+{
+	unsigned char tail = cmd_tail;
+
+	if (tail == cmd_head)
+		return false;
+	__sync_synchronize();		// see the record the head index covers
+	*c = cmd_ring[tail & (CMD_RING - 1)];
+	__sync_synchronize();		// done reading before the slot is released
+	cmd_tail = tail + 1;
+	return true;
+}
+
+/****
+ *
+ * Button capture
+ *
+ ****/
+
+void IRAM_ATTR buttonIsr()
+{
+	btn_edge(millis(), digitalRead(PIN_BUTTON));
+}
+
+/*
+ * A release that bounces inside the debounce window can leave
+ * btn_level wrong.  Once the pin has been quiet long enough, trust it.
+ */
+static void btn_resync(unsigned long t)
+{
+	noInterrupts();
+	if (t - btn_last_edge >= BTN_DEBOUNCE && digitalRead(PIN_BUTTON) != btn_level) {
+		btn_level = !btn_level;
+		btn_last_edge = t;
+	}
+	interrupts();
+}
+
 /****
  *
  * Message Handlers
  *
  * NOTE: the message handlers are called asynchronously from the TCP/IP upcal.
  * We assume this means they may be called from an interrupt at any time.
- * For this reason their function is mostly to record stuff for later
- * processing in the loop code.
+ * For this reason they only validate the message and queue a command
+ * for the loop code.  They never touch state owned by loop().
  *
  ****/
 
@@ -105,8 +952,7 @@ bool broadcastHandler(const String& level, const String& value) {
 
 	if (t < 0) return false;
 
-	queued_time_base = t - millis()/1000;
-	return true;
+	return cmd_put(CMD_TIME_BASE, t - millis()/1000);
   }
   return false;
 }
@@ -117,14 +963,8 @@ bool outletOnHandler(const HomieRange& range, const String& value) {
   // If we don't understand the value then we didn't handle the message
   if (value != "true" && value != "false") return false;
 
-  bool desired = (value == "true");
-  if (desired != on) {
-	  desired_remote_set = desired;
-	  queued_remote_set = true;
-  }
-
-  // Message handled
-  return true;
+  // Message handled, unless there was no room to queue it
+  return cmd_put(CMD_ON, value == "true");
 }
 
 // Handle "time-on" messages
@@ -133,9 +973,7 @@ bool outletTOnHandler(const HomieRange& range, const String& value) {
 
   if (t < 0) return false;
 
-  time_to_turn_on = t;
-  queued_ton = true;
-  return true;
+  return cmd_put(CMD_TIME_ON, t);
 }
 
 // Handle "time-off" messages
@@ -144,20 +982,39 @@ bool outletTOffHandler(const HomieRange& range, const String& value) {
 
   if (t < 0) return false;
 
-  time_to_turn_off = t;
-  queued_toff = true;
+  return cmd_put(CMD_TIME_OFF, t);
+}
+
+// Handle "schedule" messages
+bool outletScheduleHandler(const HomieRange& range, const String& value) {
+  // loop() has not picked up the last one yet
+  if (sched_staged_busy) {
+    cmd_dropped = cmd_dropped + 1;
+    return false;
+  }
+  if (!sched_parse(value.c_str())) return false;
+
+  sched_staged_busy = true;
+  if (!cmd_put(CMD_SCHEDULE, 0)) {
+    sched_staged_busy = false;
+    return false;
+  }
   return true;
 }
 
+// Handle "mode" messages
+bool outletModeHandler(const HomieRange& range, const String& value) {
+  if (value == "eco") return cmd_put(CMD_MODE, MODE_ECO);
+  if (value == "low-latency") return cmd_put(CMD_MODE, MODE_LOW_LATENCY);
+  return false;
+}
+
 // Nothing to do when someone clears this state.
 bool buttonSetHandler(const HomieRange& range, const String& value) {
   // If we don't understand the value then we didn't handle the message
   if (value != "true" && value != "false") return false;
 
-  buttonState = (value == "true");
-  buttonNode.setProperty("button").send(value);
-
-  return true;
+  return cmd_put(CMD_BUTTON, value == "true");
 }
 
 
@@ -169,12 +1026,58 @@ void setupHandler() {
   // turn on blue LED for 2 seconds
 /*xxx*/Serial.println("setupHandler");
   digitalWrite(PIN_LED, HIGH);
+  led_level = HIGH;
   led_can_change = millis() + 2000;
-  connected = true;
+}
+
+/*
+ * Homie events.  Track the broker link and its acknowledgements, and
+ * resync all properties each time we get (re)connected to the broker.
+ */
+void onHomieEvent(const HomieEvent& event) {
+  unsigned char i;
+
+  switch (event.type) {
+    case HomieEventType::MQTT_READY:
+      connected = true;
+      pub_resync = true;
+      break;
+    case HomieEventType::MQTT_DISCONNECTED:
+    case HomieEventType::WIFI_DISCONNECTED:
+      connected = false;
+      break;
+    case HomieEventType::MQTT_PACKET_ACKNOWLEDGED:
+      for (i = 0; i < PUB_N; i++)
+        if (pub_packet[i] == event.packetId) {
+          pub_acked[i] = pub_sent[i];
+          pub_packet[i] = 0;
+        }
+      break;
+    default:
+      break;
+  }
 }
 
 void setup() {
   void loopHandler();
+
+  // Get the relay back to where it was before anything else
+  time_base = 0;
+  on = false;
+  reason = REASON_BOOT;
+  time_to_turn_on = 0;
+  time_to_turn_off = 0;
+  time_last_change = 0;
+  sched_count = 0;
+  persist_restore();
+  pinMode(PIN_RELAY, OUTPUT);
+  digitalWrite(PIN_RELAY, on ? HIGH : LOW);
+  relay_level = on;
+  persist_dirty = false;
+  persist_flash_pending = false;
+  persist_rtc_time = millis();
+  persist_flash_time = millis() - PERSIST_FLASH_BATCH;
+
   Serial.begin(115200);
   Serial.println(FIRMWARE_NAME);
   Serial.println(FIRMWARE_VERSION);
@@ -182,25 +1085,30 @@ void setup() {
 
   connected = false;
 
-  debouncer.attach(PIN_BUTTON, INPUT); // Attach the debouncer to the pin
-  debouncer.interval(25); // Use a debounce interval of 25 milliseconds
-
-  pinMode(PIN_RELAY, OUTPUT);
+  pinMode(PIN_BUTTON, INPUT);
   pinMode(PIN_LED, OUTPUT);
-  digitalWrite(PIN_RELAY, LOW);
-  time_base = 0;
-  queued_time_base = 0;
-  on = false;
+  btn_head = 0;
+  btn_tail = 0;
+  btn_pending = false;
+  btn_level = digitalRead(PIN_BUTTON);
+  btn_last_edge = millis();
+  attachInterrupt(digitalPinToInterrupt(PIN_BUTTON), buttonIsr, CHANGE);
   buttonState = false;
-  reason = REASON_BOOT;
-  queued_reason = true;
-  time_to_turn_on = 0;
-  queued_ton = true;
-  time_to_turn_off = 0;
-  queued_toff = true;
-  time_last_change = 0;
-  queued_time_last_change = true;
-  queued_remote_set = false;
+  sched_staged_busy = false;
+  cmd_head = 0;
+  cmd_tail = 0;
+  cmd_dropped = 0;
+  cmd_dropped_published = 0;
+  sched_rebuild(time_base + millis()/1000);
+  mode = MODE_LOW_LATENCY;
+  loop_rate = 0;
+  idle_pct = 0;
+  stats_start = millis();
+  stats_loops = 0;
+  stats_idle_us = 0;
+  led_level = -1;
+  pub_dirty = PUB_ALL;
+  pub_resync = false;
   digitalWrite(PIN_LED, LOW);
 
   Homie_setFirmware(FIRMWARE_NAME, FIRMWARE_VERSION);
@@ -211,10 +1119,17 @@ void setup() {
   outletNode.advertise("time-on").settable(outletTOnHandler);
   outletNode.advertise("time-off").settable(outletTOffHandler);
   outletNode.advertise("time-last-change");
+  outletNode.advertise("schedule").settable(outletScheduleHandler);
+  outletNode.advertise("schedule-next");
+  outletNode.advertise("cmd-dropped");
+  outletNode.advertise("mode").settable(outletModeHandler);
+  outletNode.advertise("loop-rate");
+  outletNode.advertise("idle");
 
   buttonNode.advertise("button").settable(buttonSetHandler);
 
   Homie.setBroadcastHandler(broadcastHandler);
+  Homie.onEvent(onHomieEvent);
 
   Homie.disableLedFeedback(); // allow this code to handle LED
 
@@ -232,44 +1147,19 @@ void setup() {
  */
 void loopHandler() {
 
-  // If we are here, then by definition we are connected.
-  connected = true;
-
-  // If we need to update the time base, block interrupts and do it here.
-  time_base = queued_time_base;
+  // Handle local button press
+  noInterrupts();
+  bool pressed = btn_pending;
+  btn_pending = false;
+  interrupts();
+  if (pressed && !buttonState) {
+    buttonState = true;
+    pub_mark(PUB_BUTTON);
+  }
 
   // If the base level code made changes, send that
   // info to Homie
-  if (queued_reason) {
-    queued_reason = false;
-    outletNode.setProperty("on").send(on? "true": "false");
-    outletNode.setProperty("reason").send(reason);
-  }
-
-  if (queued_ton) {
-    queued_ton = false;
-    outletNode.setProperty("time-on").send(l_to_s(time_to_turn_on));
-  }
-
-  if (queued_toff) {
-    queued_toff = false;
-    outletNode.setProperty("time-off").send(l_to_s(time_to_turn_off));
-  }
-
-  if (queued_time_last_change) {
-    queued_time_last_change = false;
-    if (time_base > 0)
-      outletNode.setProperty("time-last-change").send(l_to_s(time_last_change));
-  }
-
-  // Handle local button press
-  if (rising) {
-    rising = false;
-    if (!buttonState) {
-      buttonState = true;
-      buttonNode.setProperty("button").send("true");
-    }
-  }
+  pub_flush();
 }
 
 /*
@@ -280,78 +1170,191 @@ void loopHandler() {
  * Notifications to the Homie system are queued to
  * be handled when connected.
  */
+static void loop_idle();
+
 void loop() {
   long now;
   long t = millis();
+  struct outlet_cmd cmd;
+  struct btn_event ev;
+  unsigned char i;
 
   now = time_base + t/1000;
 
-  // Process commands we received through Homie
-  if (queued_remote_set) {
-	queued_remote_set = false;
-  	on = desired_remote_set;
-	reason = REASON_REMOTE;
-	queued_reason = true;
-	queued_time_last_change = true;
-	time_last_change = now;
+  // Catch up with what the button interrupt did to the relay.
+  // Do this before anything else here changes on.
+  while (btn_get(&ev)) {
+	if (ev.what == BTN_TOGGLED && ev.level != on)
+		relay_change(ev.level, REASON_LOCAL, time_base + ev.t/1000);
   }
+  if (btn_head == btn_tail && relay_level != on)
+	relay_change(relay_level, REASON_LOCAL, now);	// ring overflowed
+  btn_resync(t);
 
-  // Process schedule events
-  if (on &&
-	time_to_turn_off &&
-	time_base &&
-	now > time_to_turn_off) {
-		on = false;
-		reason = REASON_TIME;
-		time_to_turn_off = 0;
-		time_last_change = now;
-		queued_reason = true;
-		queued_toff = true;
-		queued_time_last_change = true;
-  }
+  // Process commands we received through Homie, oldest first
+  while (cmd_get(&cmd)) switch (cmd.kind) {
+	case CMD_TIME_BASE:
+		// The first time base, or a big jump, re-anchors the recurring schedule entries.
+		if (cmd.arg != time_base) {
+			long old = time_base;
 
-  if (!on &&
-	time_to_turn_on &&
-	time_base &&
-	now > time_to_turn_on) {
-		on = true;
-		reason = REASON_TIME;
-		time_to_turn_on = 0;
-		time_last_change = now;
-		queued_reason = true;
-		queued_ton = true;
-		queued_time_last_change = true;
+			time_base = cmd.arg;
+			now = time_base + t/1000;
+			if (old == 0 || labs(time_base - old) > SCHED_SLEW)
+				sched_rebuild(now);
+			if (old == 0)
+				pub_mark(PUB_TIME_LAST_CHANGE);
+		}
+		break;
+	case CMD_ON:
+		if (cmd.arg != on)
+			relay_change(cmd.arg, REASON_REMOTE, now);
+		break;
+	case CMD_TIME_ON:
+		time_to_turn_on = cmd.arg;
+		pub_mark(PUB_TIME_ON);
+		sched_set_once(SCHED_TON, time_to_turn_on, true);
+		break;
+	case CMD_TIME_OFF:
+		time_to_turn_off = cmd.arg;
+		pub_mark(PUB_TIME_OFF);
+		sched_set_once(SCHED_TOFF, time_to_turn_off, false);
+		break;
+	case CMD_SCHEDULE:
+		for (i = 0; i < sched_staged_count; i++)
+			sched[SCHED_FIRST + i] = sched_staged[i];
+		sched_count = sched_staged_count;
+		__sync_synchronize();
+		sched_staged_busy = false;
+		sched_rebuild(now);
+		pub_mark(PUB_SCHEDULE);
+		break;
+	case CMD_BUTTON:
+		buttonState = cmd.arg;
+		pub_mark(PUB_BUTTON);
+		break;
+	case CMD_MODE:
+		if (cmd.arg != mode) {
+			mode = cmd.arg;
+			WiFi.setSleepMode(mode == MODE_ECO? WIFI_LIGHT_SLEEP: WIFI_MODEM_SLEEP);
+			pub_mark(PUB_MODE);
+		}
+		break;
   }
 
-  // Process push button
-  // Note that if we get two rising edges before
-  // Homie does anything with it, we assume we are not connected.
-  debouncer.update(); // Update the Bounce instance
-  if (debouncer.rose()) {
-	if (!connected || rising) {
-		rising = false;
-		on = !on;
-		reason = REASON_LOCAL;
-		queued_reason = true;
-		time_last_change = now;
-		queued_time_last_change = true;
-	} else
-		rising = true;
+  if (cmd_dropped != cmd_dropped_published) {
+	cmd_dropped_published = cmd_dropped;
+	pub_mark(PUB_CMD_DROPPED);
   }
 
-  // Push any local-mode changes in relay state to the hardware
-  digitalWrite(PIN_RELAY, on ? HIGH : LOW);
+  // Process schedule events.  The heap keeps the earliest one on top.
+  while (time_base &&
+	sched_n > 0 &&
+	now >= sched[sched_heap[0]].when)
+		sched_fire(now);
+
+  persist_flush(t, now);
+
+  // Push any local-mode changes in relay state to the hardware.
+  // If the interrupt got in since we looked, leave it to the next pass.
+  noInterrupts();
+  if (btn_head == btn_tail && relay_level != on) {
+	relay_level = on;
+	digitalWrite(PIN_RELAY, on? HIGH: LOW);
+  }
+  interrupts();
 
   // This section controls blinking our current state on the LED.
   if (t > led_can_change) {
+    int level;
+
     // blink 1 HZ, 5% cycle when connected, 0.2HZ 5% when not
     if (!connected)
     	t /= 5;
-    digitalWrite(PIN_LED, ((t/50)%20 != 0)? HIGH: LOW); 
+    level = ((t/50)%20 != 0)? HIGH: LOW;
+    if (level != led_level) {
+    	led_level = level;
+    	digitalWrite(PIN_LED, level);
+    }
   }
 
-  // Set connected = false here.  If we get to the 
-  // Homie loop handler it will be set to true.
-  connected = false;
   Homie.loop();
+
+  loop_idle();
+}
+
+/*
+ * How many milliseconds until loop() next has work of its own to do.
+ * Commands and button presses that arrive sooner are picked up late,
+ * but the button interrupt has already switched the relay.
+ */
+static unsigned long loop_next_deadline()
+{
+	unsigned long t = millis();
+	unsigned long wait = IDLE_MAX;
+	unsigned long r, d;
+
+	// Work already waiting, or the button debounce resync is due soon
+	if (btn_head != btn_tail || cmd_head != cmd_tail || (connected && pub_dirty))
+		return 0;
+	if (t - btn_last_edge < BTN_DEBOUNCE)
+		wait = BTN_DEBOUNCE - (t - btn_last_edge);
+
+	// Next schedule event.  Anything more than a sleep away is left
+	// for a later pass, so the seconds never overflow as milliseconds.
+	if (time_base && sched_n > 0) {
+		long s = sched[sched_heap[0]].when - (time_base + (long)(t / 1000));
+		long ms;
+
+		if (s <= 0)
+			return 0;
+		if (s <= IDLE_MAX / 1000 + 1) {
+			ms = s * 1000 - (long)(t % 1000);
+			if ((unsigned long)ms < wait)
+				wait = ms;
+		}
+	}
+
+	// Next LED edge.  The pattern runs 5 times slower when not connected.
+	if ((long)t <= led_can_change) {
+		d = led_can_change - t + 1;
+	} else if (connected) {
+		r = t % 1000;
+		d = (r < 50)? 50 - r: 1000 - r;
+	} else {
+		r = (t / 5) % 1000;
+		d = ((r < 50)? 50 - r: 1000 - r) * 5 - t % 5;
+	}
+	if (d < wait)
+		wait = d;
+
+	return wait;
+}
+
+/*
+ * End of each loop() pass.  In eco mode sleep until the next deadline,
+ * letting the WiFi stack light sleep.  Also keep the loop statistics.
+ */
+static void loop_idle()
+{
+	unsigned long t, wait, us;
+
+	stats_loops++;
+	if (mode == MODE_ECO && (wait = loop_next_deadline()) > 0) {
+		us = micros();
+		delay(wait);
+		stats_idle_us += micros() - us;
+	}
+
+	t = millis();
+	if (t - stats_start >= STATS_PERIOD) {
+		unsigned long period = t - stats_start;
+
+		loop_rate = stats_loops * 1000 / period;
+		idle_pct = stats_idle_us / (period * 10);
+		stats_start = t;
+		stats_loops = 0;
+		stats_idle_us = 0;
+		pub_mark(PUB_LOOP_RATE | PUB_IDLE);
+	}
 }
@@ -0,0 +1,237 @@
+//
+// Native tests for the button capture: pio test -e native
+//
+// btn_edge() is what the pin change interrupt runs, and btn_get() is
+// how loop() takes the presses.  Here the edges come from the test, the
+// relay pin is a variable, and nothing else of the firmware is built.
+//
+#include <unity.h>
+
+#define	LOW		0
+#define	HIGH		1
+#define	PIN_RELAY	15
+
+static bool connected;
+static int relay_pin = -1;		// last level written to the relay
+static int relay_writes;
+
+static void digitalWrite(int pin, int level)
+{
+	TEST_ASSERT_EQUAL(PIN_RELAY, pin);
+	relay_pin = level;
+	relay_writes++;
+}
+
+#include "button.h"
+
+static unsigned long now;		// ms
+
+// The button goes to level at now, and stays there for ms
+static void edge(bool level, unsigned long ms)
+{
+	btn_edge(now, level);
+	now += ms;
+}
+
+// A clean press: down for 100 ms, up for 100 ms
+static void press()
+{
+	edge(true, 100);
+	edge(false, 100);
+}
+
+// A press that chatters for a few ms each way, as real contacts do
+static void bouncy_press()
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		edge(true, 1);
+		edge(false, 2);
+	}
+	edge(true, 100);
+	for (i = 0; i < 3; i++) {
+		edge(false, 3);
+		edge(true, 1);
+	}
+	edge(false, 100);
+}
+
+static int count()
+{
+	return (unsigned char)(btn_head - btn_tail);
+}
+
+void setUp(void)
+{
+	btn_head = 0;
+	btn_tail = 0;
+	relay_level = false;
+	btn_pending = false;
+	btn_level = false;
+	now = 1000;
+	btn_last_edge = 0;
+	connected = false;
+	relay_pin = -1;
+	relay_writes = 0;
+}
+
+void tearDown(void)
+{
+}
+
+void test_offline_press_toggles(void)
+{
+	struct btn_event ev;
+
+	press();
+	TEST_ASSERT_EQUAL(1, count());
+	TEST_ASSERT_EQUAL(HIGH, relay_pin);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_TOGGLED, ev.what);
+	TEST_ASSERT_TRUE(ev.level);
+	TEST_ASSERT_EQUAL(1000, ev.t);
+	TEST_ASSERT_FALSE(btn_get(&ev));
+
+	press();
+	TEST_ASSERT_EQUAL(LOW, relay_pin);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_FALSE(ev.level);
+}
+
+void test_bounce(void)
+{
+	struct btn_event ev;
+
+	bouncy_press();
+	TEST_ASSERT_EQUAL(1, count());
+	TEST_ASSERT_EQUAL(1, relay_writes);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(1000, ev.t);		// timed from the first edge
+
+	bouncy_press();
+	TEST_ASSERT_EQUAL(1, count());
+	TEST_ASSERT_EQUAL(2, relay_writes);
+	TEST_ASSERT_EQUAL(LOW, relay_pin);
+}
+
+void test_release_bounce_is_not_a_press(void)
+{
+	edge(true, 100);
+	edge(false, 10);
+	edge(true, 5);			// inside the debounce window: ignored
+	edge(false, 100);
+	TEST_ASSERT_EQUAL(1, count());
+
+	// ...but a real second press after the window counts
+	edge(true, 100);
+	edge(false, 100);
+	TEST_ASSERT_EQUAL(2, count());
+}
+
+void test_online_press_is_reported(void)
+{
+	struct btn_event ev;
+
+	connected = true;
+	press();
+	TEST_ASSERT_EQUAL(0, relay_writes);
+	TEST_ASSERT_TRUE(btn_pending);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_REPORT, ev.what);
+	TEST_ASSERT_FALSE(ev.level);
+}
+
+void test_double_press(void)
+{
+	struct btn_event ev;
+
+	// Online, and the first press isn't reported before the second:
+	// the second toggles the relay itself
+	connected = true;
+	press();
+	press();
+	TEST_ASSERT_FALSE(btn_pending);
+	TEST_ASSERT_EQUAL(1, relay_writes);
+	TEST_ASSERT_EQUAL(HIGH, relay_pin);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_REPORT, ev.what);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_TOGGLED, ev.what);
+	TEST_ASSERT_TRUE(ev.level);
+
+	// Reported in between: both are reports
+	press();
+	btn_pending = false;		// as loopHandler() does
+	press();
+	TEST_ASSERT_EQUAL(1, relay_writes);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_REPORT, ev.what);
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_REPORT, ev.what);
+}
+
+void test_ring_overflow(void)
+{
+	struct btn_event ev;
+	int i;
+
+	// Fill the ring offline, then one more press online: a report
+	// that finds no room, and must not touch the oldest event
+	for (i = 0; i < BTN_RING; i++)
+		press();
+	TEST_ASSERT_EQUAL(BTN_RING, count());
+	connected = true;
+	press();
+	TEST_ASSERT_EQUAL(BTN_RING, count());
+	TEST_ASSERT_TRUE(btn_get(&ev));
+	TEST_ASSERT_EQUAL(BTN_TOGGLED, ev.what);	// not the lost report
+	TEST_ASSERT_TRUE(ev.level);
+	TEST_ASSERT_EQUAL(1000, ev.t);
+	press();				// a second press toggles
+	TEST_ASSERT_EQUAL(BTN_RING, count());
+
+	// The relay still followed every press that toggled it
+	TEST_ASSERT_EQUAL(BTN_RING + 1, relay_writes);
+	TEST_ASSERT_TRUE(relay_level);
+	TEST_ASSERT_EQUAL(HIGH, relay_pin);
+
+	// The events that made it in are untouched
+	for (i = 1; i < BTN_RING; i++) {
+		TEST_ASSERT_TRUE(btn_get(&ev));
+		TEST_ASSERT_EQUAL(BTN_TOGGLED, ev.what);
+		TEST_ASSERT_EQUAL(i % 2 == 0, ev.level);
+		TEST_ASSERT_EQUAL(1000 + 200 * i, ev.t);
+	}
+	TEST_ASSERT_TRUE(btn_get(&ev));		// the toggle that got the room
+	TEST_ASSERT_EQUAL(BTN_TOGGLED, ev.what);
+	TEST_ASSERT_TRUE(ev.level);
+	TEST_ASSERT_FALSE(btn_get(&ev));
+
+	// and there is room again
+	press();
+	TEST_ASSERT_EQUAL(1, count());
+}
+
+void test_millis_wrap(void)
+{
+	now = 0xffffffffUL - 50;
+	btn_last_edge = now - 1000;
+	bouncy_press();
+	TEST_ASSERT_EQUAL(1, count());
+	press();
+	TEST_ASSERT_EQUAL(2, count());
+}
+
+int main(void)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_offline_press_toggles);
+	RUN_TEST(test_bounce);
+	RUN_TEST(test_release_bounce_is_not_a_press);
+	RUN_TEST(test_online_press_is_reported);
+	RUN_TEST(test_double_press);
+	RUN_TEST(test_ring_overflow);
+	RUN_TEST(test_millis_wrap);
+	return UNITY_END();
+}
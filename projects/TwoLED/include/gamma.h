@@ -0,0 +1,64 @@
+/*
+ * Gamma.
+ *
+ * The eye sees brightness roughly as the cube root of light output, so
+ * intensity is taken as CIE lightness (L* = 100 * intensity / 255) and
+ * turned into a duty cycle with the CIE 1931 formula:
+ *   Y = ((L* + 16) / 116)^3, or L* / 903.3 when L* <= 8.
+ * gamma_table[c] is the duty cycle for intensity c, out of LED_DUTY_MAX.
+ * It is all worked out by the compiler in integer arithmetic; nothing but
+ * the table itself reaches the chip.  Any intensity above zero gets a
+ * duty of at least 1, so it never rounds down to off.
+ *
+ * Only needs the compiler, so the native tests in test/ see the same
+ * table the LEDs do.
+ */
+#ifndef GAMMA_H
+#define GAMMA_H
+
+#define	LED_DUTY_MAX	65535		// duty cycle for fully on
+
+constexpr unsigned short cieDuty(unsigned long long l) {
+	// l is L* * 255
+	return l <= 8 * 255?
+		l * LED_DUTY_MAX * 10 / (255ULL * 9033):
+		(l + 16 * 255) * (l + 16 * 255) * (l + 16 * 255) * LED_DUTY_MAX /
+			((116ULL * 255) * (116 * 255) * (116 * 255));
+}
+
+constexpr unsigned short gammaEntry(int c) {
+	return c == 0? 0: cieDuty(c * 100ULL) < 1? 1: cieDuty(c * 100ULL);
+}
+
+// 0, 1, ... N-1 as a template parameter pack, to fill in the table
+template <int... I> struct int_seq {};
+template <int N, int... I> struct make_int_seq: make_int_seq<N-1, N-1, I...> {};
+template <int... I> struct make_int_seq<0, I...> { typedef int_seq<I...> type; };
+
+struct gamma_lut {
+	unsigned short duty[256];
+};
+
+template <int... I> constexpr gamma_lut gammaMake(int_seq<I...>) {
+	return gamma_lut{{gammaEntry(I)...}};
+}
+
+constexpr gamma_lut gamma_table = gammaMake(make_int_seq<256>::type());
+static_assert(gamma_table.duty[255] == LED_DUTY_MAX, "full intensity must be fully on");
+static_assert(gamma_table.duty[1] > 0, "lowest intensity must not be off");
+
+/*
+ * Duty cycle for level (intensity * 257), interpolating between gamma
+ * table entries for the fraction of an intensity step.
+ */
+static inline __attribute__((always_inline)) unsigned long ledDuty(unsigned short level) {
+	unsigned short pos = level - (level >> 8);	// intensity * 256
+	unsigned char c = pos >> 8;
+	unsigned long duty = gamma_table.duty[c];
+
+	if (c < 255)
+		duty += (gamma_table.duty[c+1] - duty) * (pos & 0xff) >> 8;
+	return duty;
+}
+
+#endif
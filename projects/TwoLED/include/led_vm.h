@@ -0,0 +1,196 @@
+/*
+ * LED programs.
+ *
+ * Each LED runs a program of up to LED_PROG_MAX bytes.  Instructions:
+ *   00		END	hold the current level forever
+ *   01 c	SET	set intensity c now
+ *   02 c MM MM	RAMP	go from the current intensity to c over MMMM ms
+ *   03 MM MM	HOLD	hold the current intensity for MMMM ms
+ *   04 n a	LOOP	jump to address a until this has been done n-1 times,
+ *			so the code from a to here runs n times.  Not nested.
+ *   05 a	JUMP	jump to address a
+ *   06 e	EASE	later RAMPs follow curve e: 0 linear, 1 ease in,
+ *			2 ease out, 3 ease in and out.  Linear at the start.
+ * Running off the end is the same as END.  Times are big endian.
+ * A new program starts at whatever level the last one left the LED,
+ * so a RAMP at the top of a program crossfades from the old one.
+ *
+ * ledVmTick() runs one program for one 1 ms tick.  It runs at most
+ * LED_VM_BUDGET instructions; a program that loops without a HOLD or
+ * RAMP just stalls for that tick.
+ *
+ * Only needs the compiler, so the native tests in test/ run the same
+ * interpreter the timer interrupt does.
+ */
+#ifndef LED_VM_H
+#define LED_VM_H
+
+#ifndef IRAM_ATTR
+#define	IRAM_ATTR
+#endif
+
+#define	LED_PROG_MAX	63		// so a struct led_prog is 64 bytes
+#define	LED_VM_BUDGET	8		// instructions per LED per tick
+
+#define	OP_END		0
+#define	OP_SET		1
+#define	OP_RAMP		2
+#define	OP_HOLD		3
+#define	OP_LOOP		4
+#define	OP_JUMP		5
+#define	OP_EASE		6
+
+#define	EASE_LINEAR	0
+#define	EASE_IN		1
+#define	EASE_OUT	2
+#define	EASE_IN_OUT	3
+#define	N_EASE		4
+
+// Word aligned, so it can be written to flash as it is
+struct led_prog {
+	unsigned char len;
+	unsigned char code[LED_PROG_MAX];
+} __attribute__((aligned(4)));
+
+// Interpreter state.  Levels are intensity * 257, so a RAMP moves in
+// 1/256 steps of intensity rather than whole ones.
+struct led_vm {
+	unsigned char pc;
+	unsigned char ramping;
+	unsigned char ease;		// curve for RAMPs
+	unsigned char loops;		// LOOP count left, 0 when not in a loop
+	unsigned short level;		// intensity now
+	unsigned short from;		// RAMP start
+	unsigned short to;		// RAMP end
+	unsigned short dur;		// length of this HOLD or RAMP
+	unsigned short left;		// ms left in it
+};
+
+// Bytes in each instruction, by opcode
+static const unsigned char op_len[] = {1, 2, 4, 3, 3, 2, 2};
+
+/*
+ * How far along a RAMP is, 0 - 65535, given how far along in time it
+ * is, also 0 - 65535.  Integer only, and no 64 bit multiplies.
+ */
+static unsigned long IRAM_ATTR ledEase(unsigned char ease, unsigned long t) {
+	unsigned long s;
+
+	switch (ease) {
+	case EASE_IN:				// t^2
+		return t * t >> 16;
+	case EASE_OUT:				// 1 - (1-t)^2
+		return 65535 - ((65535 - t) * (65535 - t) >> 16);
+	case EASE_IN_OUT:			// t^2 (3 - 2t)
+		s = t * t >> 16;
+		return s * (49152 - (t >> 1)) >> 14;
+	default:
+		return t;
+	}
+}
+
+// Start a new program from the top, at whatever level the LED is
+static inline __attribute__((always_inline)) void ledVmStart(struct led_vm *vm) {
+	vm->pc = 0;
+	vm->left = 0;
+	vm->loops = 0;
+	vm->ease = EASE_LINEAR;
+}
+
+/*
+ * Run prog for one tick, and return the level.  Finish off the current
+ * HOLD or RAMP millisecond first; once that is done run instructions
+ * until one takes time, the program ends, or the budget runs out.
+ */
+static inline __attribute__((always_inline)) unsigned short ledVmTick(struct led_vm *vm, const struct led_prog *prog) {
+	const unsigned char *code = prog->code;
+	unsigned char budget = LED_VM_BUDGET;
+
+	if (vm->left > 0) {
+		vm->left--;
+		if (vm->ramping) {
+			unsigned long t = (unsigned long)(vm->dur - vm->left) * 65536 / vm->dur;
+			long e = ledEase(vm->ease, t > 65535? 65535: t) >> 8;
+
+			vm->level = vm->from + (((long)vm->to - vm->from) * e >> 8);
+			if (vm->left == 0)
+				vm->level = vm->to;
+		}
+	}
+
+	while (vm->left == 0 && vm->pc < prog->len && budget-- > 0) {
+		unsigned char pc = vm->pc;
+
+		switch (code[pc]) {
+		case OP_SET:
+			vm->level = code[pc+1] * 257;
+			vm->pc += 2;
+			break;
+		case OP_RAMP:
+			vm->from = vm->level;
+			vm->to = code[pc+1] * 257;
+			vm->dur = vm->left = code[pc+2] << 8 | code[pc+3];
+			vm->ramping = 1;
+			if (vm->dur == 0)
+				vm->level = vm->to;
+			vm->pc += 4;
+			break;
+		case OP_HOLD:
+			vm->dur = vm->left = code[pc+1] << 8 | code[pc+2];
+			vm->ramping = 0;
+			vm->pc += 3;
+			break;
+		case OP_LOOP:
+			if (vm->loops == 0)
+				vm->loops = code[pc+1];
+			if (--vm->loops > 0)
+				vm->pc = code[pc+2];
+			else
+				vm->pc += 3;
+			break;
+		case OP_JUMP:
+			vm->pc = code[pc+1];
+			break;
+		case OP_EASE:
+			vm->ease = code[pc+1];
+			vm->pc += 2;
+			break;
+		default:
+			vm->pc = prog->len;		// END
+			break;
+		}
+	}
+	return vm->level;
+}
+
+/*
+ * Program builders.  Each writes its code at c and returns the end.
+ */
+
+// Get from wherever the LED is to intensity to in ms milliseconds
+static inline unsigned char *ledTransition(unsigned char *c, unsigned char to, unsigned short ms, unsigned char ease) {
+	*c++ = OP_EASE; *c++ = ease;
+	*c++ = OP_RAMP; *c++ = to; *c++ = ms >> 8; *c++ = ms & 0xff;
+	return c;
+}
+
+// Blink n times at intensity, on for on_ms and off for off_ms, then
+// stay off for pause_ms, forever: on, off, on, off ... on, pause
+static inline unsigned char *ledBlink(unsigned char *c, unsigned char intensity, unsigned char n,
+    unsigned short on_ms, unsigned short off_ms, unsigned short pause_ms) {
+	*c++ = OP_SET; *c++ = intensity;
+	*c++ = OP_HOLD; *c++ = on_ms >> 8; *c++ = on_ms & 0xff;
+	*c++ = OP_SET; *c++ = 0;
+	if (n > 1) {
+		*c++ = OP_HOLD; *c++ = off_ms >> 8; *c++ = off_ms & 0xff;
+		*c++ = OP_LOOP; *c++ = n - 1; *c++ = 0;
+		*c++ = OP_SET; *c++ = intensity;
+		*c++ = OP_HOLD; *c++ = on_ms >> 8; *c++ = on_ms & 0xff;
+		*c++ = OP_SET; *c++ = 0;
+	}
+	*c++ = OP_HOLD; *c++ = pause_ms >> 8; *c++ = pause_ms & 0xff;
+	*c++ = OP_JUMP; *c++ = 0;
+	return c;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Expander.
+ *
+ * The firmware's LEDs N_GPIO_LEDS and up are channels 0 and up of a PCA9685 16 channel,
+ * 12 bit PWM chip on I2C.  The bus is far too slow for the interrupt, so
+ * the interrupt only keeps each channel's duty in pca_duty[] and marks
+ * the ones that change in pca_dirty.  Every PCA9685_FRAME ms loop() takes
+ * the dirty set and writes it out.  The chip's registers auto-increment,
+ * so each run of neighbouring dirty channels goes out as one transaction;
+ * when everything changes, that is one transaction for the lot.
+ *
+ * A pca_duty[] of 4096 means fully on, 0 fully off; the chip has a bit
+ * for each, apart from the 12 bit on/off times.
+ *
+ * The includer says how many channels are wired (PCA9685_LEDS) and which
+ * way round (PCA9685_ON_VALUE), and supplies Wire and the interrupt
+ * calls.  The native test in test/test_pca gives it a fake Wire and
+ * checks what would go down the bus.
+ */
+#ifndef PCA9685_H
+#define PCA9685_H
+
+#include "gamma.h"
+
+#ifndef IRAM_ATTR
+#define	IRAM_ATTR
+#endif
+
+#define	PCA9685_ADDR	0x40
+#define	PCA9685_CLOCK	400000		// I2C clock, Hz
+#define	PCA9685_FRAME	10		// ms between bus writes
+#define	PCA9685_PRESCALE	5	// 25 MHz / 4096 / (5 + 1) = 1017 Hz PWM
+
+#define	PCA9685_MODE1	0x00
+#define	PCA9685_MODE2	0x01
+#define	PCA9685_LED0	0x06		// LED0_ON_L; 4 registers per channel
+#define	PCA9685_PRE_SCALE	0xfe
+#define	PCA9685_AI	0x20		// MODE1: auto-increment
+#define	PCA9685_SLEEP	0x10		// MODE1: oscillator off
+#define	PCA9685_ALLCALL	0x01		// MODE1: answer the all-call address
+#define	PCA9685_INVRT	0x10		// MODE2: invert outputs
+#define	PCA9685_OUTDRV	0x04		// MODE2: totem pole outputs
+#define	PCA9685_FULL	0x10		// LEDn_ON_H / LEDn_OFF_H: fully on / off
+
+static_assert(PCA9685_LEDS <= 16, "one PCA9685 has 16 channels");
+static_assert(1 + 4 * PCA9685_LEDS <= BUFFER_LENGTH, "a full refresh must fit one Wire transaction");
+
+static unsigned short pca_duty[PCA9685_LEDS];	// 0 - 4096, written by the interrupt
+static volatile uint32_t pca_dirty;		// bit per channel: duty not on the chip yet
+static bool pca_present;			// chip answered at boot
+
+// Bus use since the last stats report
+static unsigned long pca_frames;
+static unsigned long pca_transactions;
+static unsigned long pca_bytes;
+static unsigned long pca_errors;
+
+// Put level on expander channel n.  Called only from the timer interrupt.
+static void IRAM_ATTR pcaWrite(int n, unsigned short level) {
+	unsigned long duty = ledDuty(level);
+	unsigned short v = duty == LED_DUTY_MAX? 4096: duty >> 4;
+
+	if (v == 0 && duty > 0)
+		v = 1;
+	if (pca_duty[n] == v)
+		return;
+	pca_duty[n] = v;
+	pca_dirty |= 1UL << n;
+}
+
+// Write one register, returning false if the chip did not answer
+static bool pcaReg(unsigned char reg, unsigned char value) {
+	Wire.beginTransmission(PCA9685_ADDR);
+	Wire.write(reg);
+	Wire.write(value);
+	return Wire.endTransmission() == 0;
+}
+
+// Set the chip up.  If it isn't there, the expander LEDs do nothing.
+static void pcaBegin() {
+	int n;
+
+	Wire.begin();
+	Wire.setClock(PCA9685_CLOCK);
+	pca_present = pcaReg(PCA9685_MODE1, PCA9685_SLEEP);	// prescale only changes asleep
+	if (!pca_present)
+		return;
+	pcaReg(PCA9685_PRE_SCALE, PCA9685_PRESCALE);
+	pcaReg(PCA9685_MODE2, PCA9685_OUTDRV | (PCA9685_ON_VALUE == LOW? PCA9685_INVRT: 0));
+	pcaReg(PCA9685_MODE1, PCA9685_AI | PCA9685_ALLCALL);
+	delayMicroseconds(500);					// oscillator start up
+	for (n = 0; n < PCA9685_LEDS; n++)
+		pca_duty[n] = 0;
+	pca_dirty = (1UL << PCA9685_LEDS) - 1;			// first frame writes them all
+}
+
+/*
+ * Send the channels that changed since the last frame, one transaction
+ * per run of neighbouring channels.  A run the chip does not take is
+ * marked dirty again for the next frame.
+ */
+static void pcaFlush() {
+	unsigned short duty[PCA9685_LEDS];
+	uint32_t dirty, run;
+	int a, b, n;
+
+	if (!pca_present)
+		return;
+	noInterrupts();
+	dirty = pca_dirty;
+	pca_dirty = 0;
+	memcpy(duty, pca_duty, sizeof duty);
+	interrupts();
+	if (dirty == 0)
+		return;
+
+	pca_frames++;
+	for (a = 0; a < PCA9685_LEDS; a = b) {
+		for (b = a; b < PCA9685_LEDS && (dirty & 1UL << b); b++)
+			;
+		if (b == a) {
+			b++;
+			continue;
+		}
+		Wire.beginTransmission(PCA9685_ADDR);
+		Wire.write(PCA9685_LED0 + 4 * a);
+		for (n = a; n < b; n++) {
+			Wire.write(0);						// ON_L
+			Wire.write(duty[n] == 4096? PCA9685_FULL: 0);		// ON_H
+			Wire.write(duty[n] & 0xff);				// OFF_L
+			Wire.write(duty[n] == 0? PCA9685_FULL: (duty[n] >> 8) & 0x0f);	// OFF_H
+		}
+		if (Wire.endTransmission() != 0) {
+			run = ((1UL << (b - a)) - 1) << a;
+			noInterrupts();
+			pca_dirty |= run;
+			interrupts();
+			pca_errors++;
+		}
+		pca_transactions++;
+		pca_bytes += 2 + 4 * (b - a);				// address, register, data
+	}
+}
+
+#endif
@@ -2,13 +2,50 @@
 /*
  * This is the firmware for a wall mounted status box that
  * has two LEDs to display
+ *
+ * The LEDs are driven from a 1 ms timer interrupt, hooked onto timer1
+ * alongside the core's PWM waveform generator.  Each LED runs a small
+ * bytecode program in that interrupt (see "LED programs" below).
+ * The waveform generator can't be called from its own timer, so the
+ * interrupt turns the PWM pins fully on and off itself, as plain GPIO,
+ * and only leaves the dimmed levels in between for loop() to hand to
+ * the waveform generator.
+ * The on property is compiled into such a program; the program property
+ * loads one directly.  The message handlers and loop() only ever replace
+ * programs, so while Homie.loop() is busy reconnecting or taking an OTA
+ * update, the programs keep running.  What reaches the LEDs meanwhile:
+ * LED 0 follows everything, and the PWM pins follow full on and off,
+ * so blinks at full intensity carry on.  A dimmed level on a PWM pin,
+ * and anything on the expander, waits for loop() to come back.
+ *
+ * The leds/state property sets every LED in one message (see
+ * ledsStateHandler()); all the new programs start on the same tick.
+ *
+ * LED 0, which is not on a PWM pin, is dimmed by the sigma-delta
+ * modulator instead.  The others use the core's PWM at a settable
+ * frequency.  Either way the duty cycle has 16 bits (see "Channels").
+ * LEDs from N_GPIO_LEDS up are on a PCA9685; the interrupt only notes
+ * which of those changed, and loop() sends them in bursts (see pca9685.h).
+ *
+ * Levels are gamma corrected on the way out (see gamma.h), and
+ * any change of on or intensity fades from wherever the LED is now to
+ * the new level, over the LED's fade time along its easing curve.
  */
 #include <Homie.h>
+#include <core_esp8266_waveform.h>
+#include <sigma_delta.h>
+#include <Wire.h>
+#include "led_vm.h"
+#include "gamma.h"
 
 #define FIRMWARE_NAME     "Two LED Control"
-#define FIRMWARE_VERSION  "0.2.0"
+#define FIRMWARE_VERSION  "0.11.0"
 
-#define	N_LEDS	3			// There are 3, the internal and 2 external
+#define	N_GPIO_LEDS	3		// There are 3, the internal and 2 external,
+#define	PCA9685_LEDS	16		// and 16 more on a PCA9685 I2C expander
+#define	N_LEDS	(N_GPIO_LEDS + PCA9685_LEDS)
+#define	PCA9685_ON_VALUE	LOW	// LEDs wired from V+ into the chip
+#include "pca9685.h"
 
 /*
  * IO Pins
@@ -17,35 +54,86 @@ const int PIN_LED = 2;
 const int PIN_LED_1 = D5;
 const int PIN_LED_2 = D6;
 #define	LED_ON_VALUE	LOW		// pull the pin low to turn on the LED
-#define	LED_OFF_VALUE	HIGH
 
 unsigned char phase;			// Startup phasing.  Blinks some stuff before we go live.
 unsigned long phase_time;		// when did we last change phases.
-void ledOn(int i);
-void ledOff(int i);
+uint32_t phase_load;			// bit per LED: table for this phase not loaded yet
+bool ledBuild(int i);
+uint32_t ledTimer();
 
 /*
  * Per LED State Variables
+ *
+ * Everything about one LED lives in one struct led_channel, below.
+ * What varies between LEDs in hardware (pin, polarity, PWM or not) is
+ * a template parameter instead (see "Channels" further down).
  */
-unsigned char on[N_LEDS];	// 0 = off, 1 = on, 2 = blinking, 3 = pausing
 #define	OFF		0
 #define	ON		1
 #define	BLINKING	2
-#define	PAUSING		3
+#define	PROGRAM		3
 #define	BLINK_ON_TIME	100	// in milliseconds
 #define	BLINK_OFF_TIME	700
 #define	PAUSE_TIME	2000
+#define	FADE_TIME	2048	// length of the startup fade
 
-int ledpin[N_LEDS] = {PIN_LED, PIN_LED_1, PIN_LED_2};
-unsigned char pwm_capable[N_LEDS] = {0, 1, 1};
-unsigned char blinks[N_LEDS]; // if blinking, how many to do
-unsigned char bcnt[N_LEDS]; // if blinking how many half phases left in string
-int timeNext[N_LEDS]; // how many milliseconds until we do something
-unsigned long lastMillis[N_LEDS];
-unsigned char intensity[N_LEDS];
-unsigned char intensity_override[N_LEDS];
-unsigned char changed[N_LEDS];
-unsigned char state[N_LEDS];
+const unsigned short boot_fade[N_LEDS] = {0, FADE_TIME, 0};	// how each LED goes out once connected
+
+/*
+ * LED programs.
+ *
+ * Each LED runs a small bytecode program; the instructions and the
+ * interpreter are in led_vm.h.  Each LED has two program buffers.  The interrupt runs the active one;
+ * loop() fills the other, then sets pending.  On its next tick the
+ * interrupt swaps them and starts the new program from the top.  loop()
+ * never touches a buffer while pending is set.
+ */
+#define	LED_TICK	1000		// microseconds per interrupt
+#define	LED_PWM_FREQ	1000		// Hz, until told otherwise
+#define	LED_PWM_FREQ_MIN	100
+#define	LED_PWM_FREQ_MAX	20000
+#define	LED_SD_FREQ	312500		// sigma-delta clock, Hz: 80 MHz / 256, prescaler 1
+#define	DEFAULT_FADE	250		// ms, until told otherwise
+#define	STATS_PERIOD	10000		// how often to publish interrupt cost, ms
+
+/*
+ * One LED.  The parts the interrupt uses every tick come first.
+ */
+struct led_channel {
+	struct led_vm vm;
+	long out;			// interrupt only: duty on the pin, -1 unknown
+	unsigned char sd_err;		// interrupt only: sigma-delta duty carried over
+	volatile bool wave_on;		// PWM: the waveform generator has the pin
+	volatile unsigned char active;	// which program buffer the interrupt runs
+	volatile bool pending;		// the other buffer is ready
+	volatile unsigned char changed;	// program needs rebuilding
+
+	// What we have been told to do
+	unsigned char on;		// 0 = off, 1 = on, 2 = blinking, 3 = running a program
+	unsigned char blinks;		// if blinking, how many to do
+	unsigned char intensity;
+	unsigned char intensity_override;
+	unsigned char fade_ease;	// easing curve for fades
+	unsigned short fade_time;	// ms to fade to a new on or intensity
+
+	struct led_prog progs[2];
+	struct led_prog user;		// last program set through the program property
+};
+
+struct led_channel led[N_LEDS];
+volatile bool led_hold;			// interrupt leaves pending programs alone
+bool led_batch;				// the changed LEDs go out together
+
+bool persist_dirty;			// orders changed since the last save
+#define	persist_mark()	(persist_dirty = true)
+bool persist_restored;			// started up with saved orders
+
+// Interrupt cost, in CPU cycles
+volatile uint32_t led_tick_max;
+volatile uint32_t led_tick_sum;
+volatile uint32_t led_tick_count;
+unsigned long stats_time;
+unsigned long pca_time;			// last expander frame
 
 /*
  * We have only one node, and it is a range node for the set of LEDs we control.
@@ -53,6 +141,288 @@ unsigned char state[N_LEDS];
 
 HomieNode ledNode("led", "simpleLedControl", "switch", true, 0, N_LEDS-1);
 
+// Every LED at once
+HomieNode ledsNode("leds", "All LEDs", "switch");
+
+// Reports what the LED interrupt costs
+HomieNode engineNode("engine", "LED engine", "stats");
+
+// Names of the easing curves, for the ease property
+const char *ease_name[N_EASE] = {"linear", "in", "out", "in-out"};
+
+/*
+ * PWM period for the LED_PWM pins, in CPU cycles, and whether it has
+ * changed since the interrupt last put it on the pins.
+ */
+volatile uint32_t led_period;
+volatile bool led_refresh;
+
+// Bit per GPIO LED: a new PWM duty in led[].out for loop() to start
+volatile uint32_t led_wave_dirty;
+
+/*
+ * Channels.
+ *
+ * led_pin<PIN, ON_VALUE, DRIVE> is what is fixed in hardware about one LED:
+ * its pin, the level on that pin that lights it, and how it is dimmed:
+ *   LED_DIGITAL	on or off, any level > 0 is on
+ *   LED_PWM		the core's waveform generator, timed in CPU cycles,
+ *			at led_period
+ *   LED_SIGMA_DELTA	the chip's sigma-delta modulator.  There is only one,
+ *			so only one LED can have it.
+ * led_bank<...> lists one per GPIO LED, in index order.  The interrupt
+ * walks the bank by template recursion, which the compiler turns into
+ * straight-line code with the pin numbers and DRIVE checks folded in.
+ * loop() walks it the same way to start the waveforms.
+ */
+#define	LED_DIGITAL	0
+#define	LED_PWM		1
+#define	LED_SIGMA_DELTA	2
+
+template <int PIN, int ON_VALUE, int DRIVE>
+struct led_pin {
+	static_assert(PIN < 16, "GPIO16 is not in GPOS / GPOC");
+	static const int sigma_delta = DRIVE == LED_SIGMA_DELTA;
+
+	static void init() {
+		pinMode(PIN, OUTPUT);
+		digitalWrite(PIN, !ON_VALUE);
+		if (DRIVE == LED_SIGMA_DELTA) {
+			sigmaDeltaSetup(0, LED_SD_FREQ);
+			sigmaDeltaAttachPin(PIN, 0);
+			GPC(PIN) &= ~(1 << GPCS);	// plain GPIO until needed
+		}
+	}
+
+	// Light or darken the LED as a plain GPIO.  digitalWrite() would
+	// stop the pin's waveform, which is not allowed in the interrupt.
+	static inline __attribute__((always_inline)) void light(bool lit) {
+		if (lit == (ON_VALUE == HIGH))
+			GPOS = 1 << PIN;
+		else
+			GPOC = 1 << PIN;
+	}
+
+	/*
+	 * Put level (intensity * 257) on the pin.  Called only from the
+	 * timer interrupt.  The duty cycle comes from ledDuty(), so it has
+	 * 16 bits all the way to the pin.  Fully on and fully off are plain
+	 * GPIO levels.
+	 *
+	 * PWM: fully on and off are written here, unless the waveform
+	 * generator has the pin.  Anything else, and taking the pin back
+	 * from the generator, is left in ch->out with the pin marked in
+	 * led_wave_dirty for wave() to pick up.
+	 *
+	 * Sigma-delta: the modulator only takes an 8 bit target, so the
+	 * rest of the duty is carried from tick to tick in ch->sd_err.  Over
+	 * 256 ms the average comes out to the full 16 bits.  The registers
+	 * are written directly; the core's sigmaDelta calls are not in IRAM.
+	 */
+	static inline __attribute__((always_inline)) void write(struct led_channel *ch, unsigned short level) {
+		unsigned long duty = DRIVE == LED_DIGITAL? (level? LED_DUTY_MAX: 0): ledDuty(level);
+
+		if (DRIVE == LED_PWM) {
+			if (ch->out == (long)duty)
+				return;
+			ch->out = duty;
+			if ((duty == 0 || duty == LED_DUTY_MAX) && !ch->wave_on)
+				light(duty);
+			else
+				led_wave_dirty |= 1UL << (ch - led);
+		} else if (duty == 0 || duty == LED_DUTY_MAX) {
+			if (ch->out == (long)duty)
+				return;
+			ch->out = duty;
+			if (DRIVE == LED_SIGMA_DELTA)
+				GPC(PIN) &= ~(1 << GPCS);
+			light(duty);
+		} else if (DRIVE == LED_SIGMA_DELTA) {
+			unsigned long target = duty + ch->sd_err;
+
+			if (ch->out == (long)duty && (duty & 0xff) == 0)
+				return;			// same as last tick, nothing to carry
+			ch->out = duty;
+			ch->sd_err = target & 0xff;
+			target >>= 8;
+			if (target > 255)
+				target = 255;
+			if (target == 0) {
+				// the modulator can't do 0, it would sit at its idle level
+				GPC(PIN) &= ~(1 << GPCS);
+				light(false);
+				return;
+			}
+			if (ON_VALUE == LOW)
+				target = 256 - target;	// high the rest of the time
+			GPSD = (GPSD & ~(0xff << GPSDT)) | target << GPSDT;
+			GPC(PIN) |= 1 << GPCS;
+		}
+	}
+
+	/*
+	 * Start the waveform for the duty the interrupt last put in
+	 * ch->out, or stop it and hand the pin back to the interrupt.
+	 * Called from loop().  The on time, spent at ON_VALUE, is
+	 * duty * led_period.
+	 */
+	static void wave(struct led_channel *ch) {
+		uint32_t period = led_period;
+		uint32_t on;
+		long duty;
+
+		if (DRIVE != LED_PWM)
+			return;
+		noInterrupts();
+		duty = ch->out;
+		if (duty > 0 && duty < LED_DUTY_MAX)
+			ch->wave_on = true;	// from here the interrupt leaves the pin alone
+		interrupts();
+		if (duty < 0)
+			return;
+		if (duty == 0 || duty == LED_DUTY_MAX) {
+			stopWaveform(PIN);
+			noInterrupts();
+			ch->wave_on = false;
+			duty = ch->out;		// may have moved on since
+			if (duty == 0 || duty == LED_DUTY_MAX)
+				light(duty);
+			interrupts();
+			return;
+		}
+		on = (uint64_t)duty * period >> 16;	// 100 Hz at 160 MHz is 1.6M cycles: 37 bits
+		if (on == 0)
+			on = 1;
+		if (ON_VALUE == LOW)
+			startWaveformClockCycles(PIN, period - on, on, 0);
+		else
+			startWaveformClockCycles(PIN, on, period - on, 0);
+	}
+};
+
+template <class... PINS> struct led_bank;
+
+template <> struct led_bank<> {
+	static const int count = 0;
+	static const int sigma_delta = 0;
+	static void init() {}
+	static void wave(struct led_channel *ch, uint32_t dirty) {}
+	static inline __attribute__((always_inline)) void tick(struct led_channel *ch) {}
+};
+
+template <class PIN, class... REST> struct led_bank<PIN, REST...> {
+	static const int count = 1 + led_bank<REST...>::count;
+	static const int sigma_delta = PIN::sigma_delta + led_bank<REST...>::sigma_delta;
+	static void init() {
+		PIN::init();
+		led_bank<REST...>::init();
+	}
+	static void wave(struct led_channel *ch, uint32_t dirty) {
+		if (dirty & 1)
+			PIN::wave(ch);
+		led_bank<REST...>::wave(ch + 1, dirty >> 1);
+	}
+	static inline __attribute__((always_inline)) void tick(struct led_channel *ch);
+};
+
+typedef led_bank<
+	led_pin<PIN_LED, LED_ON_VALUE, LED_SIGMA_DELTA>,
+	led_pin<PIN_LED_1, LED_ON_VALUE, LED_PWM>,
+	led_pin<PIN_LED_2, LED_ON_VALUE, LED_PWM>
+> leds;
+static_assert(leds::count == N_GPIO_LEDS, "one led_pin per GPIO LED");
+static_assert(leds::sigma_delta <= 1, "there is only one sigma-delta modulator");
+
+/*
+ * Check a program.  Every instruction must be complete and every jump
+ * must land on an instruction, so the interrupt never has to check anything.
+ */
+bool ledProgCheck(const unsigned char *code, int len) {
+	unsigned char start[LED_PROG_MAX];
+	int pc, target;
+
+	memset(start, 0, sizeof start);
+	for (pc = 0; pc < len; pc += op_len[code[pc]]) {
+		if (code[pc] >= sizeof op_len)
+			return false;
+		if (pc + op_len[code[pc]] > len)
+			return false;
+		if (code[pc] == OP_LOOP && code[pc+1] == 0)
+			return false;
+		if (code[pc] == OP_EASE && code[pc+1] >= N_EASE)
+			return false;
+		start[pc] = 1;
+	}
+	for (pc = 0; pc < len; pc += op_len[code[pc]]) {
+		if (code[pc] == OP_LOOP)
+			target = code[pc+2];
+		else if (code[pc] == OP_JUMP)
+			target = code[pc+1];
+		else
+			continue;
+		if (target >= len || !start[target])
+			return false;
+	}
+	return true;
+}
+
+// Value of one hex digit, or -1
+int hexDigit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * The value coming in is a program in hex, two digits a byte.
+ * Spaces are allowed between bytes.  An empty value turns the LED off.
+ */
+bool ledProgramHandler(const HomieRange& range, const String& value) {
+  int i, n, hi, lo;
+  unsigned char code[LED_PROG_MAX];
+  const char *p;
+
+  if (!range.isRange)
+	  return false;				// If it isn't a range, then give up.
+
+  if (range.index < 0 || range.index >= N_LEDS)
+  	return false;				// If range is out of range ignore it.
+  i = range.index;
+
+  for (n = 0, p = value.c_str(); *p; ) {
+    if (*p == ' ') {
+	    p++;
+	    continue;
+    }
+    if ((hi = hexDigit(p[0])) < 0 || (lo = hexDigit(p[1])) < 0 || n >= LED_PROG_MAX)
+	    return false;			// not hex, or too long
+    code[n++] = hi << 4 | lo;
+    p += 2;
+  }
+  if (n == 0) {
+	  code[n++] = OP_SET;			// empty: off, and stay off
+	  code[n++] = 0;
+	  code[n++] = OP_END;
+  }
+  if (!ledProgCheck(code, n))
+	  return false;
+
+  if (led[i].on != PROGRAM || led[i].user.len != n || memcmp(led[i].user.code, code, n) != 0) {
+	memcpy(led[i].user.code, code, n);
+	led[i].user.len = n;
+	led[i].on = PROGRAM;
+	led[i].changed = 1;
+	persist_mark();
+  }
+
+  ledNode.setProperty("program").setRange(i).send(value);
+  return true;
+}
+
 /*
  * The value coming in is an integer, represented as a string.
  * If the value is <= 0, LED is off.
@@ -79,9 +449,10 @@ bool ledIntensityHandler(const HomieRange& range, const String& value) {
   if (numericValue > 255)
   	return false;				// can't be negative, as we rejected input with '-' in it.
   
-  if (numericValue != intensity[i]) {
-  	intensity[i] = numericValue;
-	changed[i] = 1;
+  if (numericValue != led[i].intensity) {
+  	led[i].intensity = numericValue;
+	led[i].changed = 1;
+	persist_mark();
 	ledNode.setProperty("intensity").setRange(i).send(value);
   }
 
@@ -114,9 +485,10 @@ bool ledIntensityOverrideHandler(const HomieRange& range, const String& value) {
   if (numericValue > 255)
   	return false;				// can't be negative, as we rejected input with '-' in it.
   
-  if (numericValue != intensity_override[i]) {
-  	intensity_override[i] = numericValue;
-	changed[i] = 1;
+  if (numericValue != led[i].intensity_override) {
+  	led[i].intensity_override = numericValue;
+	led[i].changed = 1;
+	persist_mark();
 	ledNode.setProperty("intensity-override").setRange(i).send(value);
   }
 
@@ -132,6 +504,7 @@ bool ledIntensityOverrideHandler(const HomieRange& range, const String& value) {
 bool ledOnHandler(const HomieRange& range, const String& value) {
   int i;
   unsigned long numericValue;
+  unsigned char new_on;
 
   if (!range.isRange)
 	  return false;				// If it isn't a range, then give up.
@@ -147,21 +520,25 @@ bool ledOnHandler(const HomieRange& range, const String& value) {
 
   numericValue = value.toInt();			// OK, what is the value?
 
-  timeNext[i] = 0;
   if (numericValue <= 0) {
-  	on[i] = OFF;
+  	new_on = OFF;
   } else if (numericValue >= 10) {
-   	on[i] = ON;
+   	new_on = ON;
   } else {
-  	on[i] = BLINKING;
-	blinks[i] = numericValue;
-	bcnt[i] = blinks[i] * 2 - 1;
-	timeNext[i] = BLINK_ON_TIME;
+  	new_on = BLINKING;
+  }
+
+  // Same orders again, e.g. the retained value after a reboot: leave it running
+  if (new_on != led[i].on || (new_on == BLINKING && numericValue != led[i].blinks)) {
+	led[i].on = new_on;
+	if (new_on == BLINKING)
+		led[i].blinks = numericValue;
+	led[i].changed = 1;
+	persist_mark();
   }
 
   ledNode.setProperty("on").setRange(i).send(value);
-  Homie.getLogger() << "LED is " << (on[i] ? "on" : "off") << endl;
-  switch (on[i]) {
+  switch (led[i].on) {
 	case OFF:
 	  Homie.getLogger() << "LED is off\n";
 	  break;
@@ -175,12 +552,219 @@ bool ledOnHandler(const HomieRange& range, const String& value) {
   return true;
 }
 
+// What every LED has been told, in the form ledsStateHandler() takes
+String ledsStateText() {
+  String s;
+  int i;
+
+  for (i = 0; i < N_LEDS; i++) {
+	if (i > 0)
+		s += ',';
+	switch (led[i].on) {
+	case ON:
+		s += "10";
+		break;
+	case BLINKING:
+		s += led[i].blinks;
+		break;
+	case PROGRAM:
+		s += 'p';
+		break;
+	default:
+		s += '0';
+		break;
+	}
+	s += '/';
+	s += led[i].intensity;
+	s += '/';
+	s += led[i].intensity_override;
+  }
+  return s;
+}
+
+/*
+ * The value coming in sets every LED at once.  It is a comma separated
+ * list, one entry per LED starting at LED 0:
+ *   on/intensity/intensity-override
+ * with each field as for the property of that name.  on may also be p,
+ * to run the LED's last program.  A missing or empty field, or a
+ * missing entry, leaves that setting alone.  "10/64,,0" turns LED 0 on
+ * at 64 and LED 2 off.
+ *
+ * Either the whole value is good and it all takes effect, with every LED
+ * starting its new program on the same tick, or none of it does.  The
+ * new state of every LED is sent back in one message.
+ */
+bool ledsStateHandler(const HomieRange& range, const String& value) {
+  int i, f;
+  long v[N_LEDS][3];		// -1 = leave alone; for on, -2 = p
+  const char *p = value.c_str();
+
+  for (i = 0; i < N_LEDS; i++)
+	  v[i][0] = v[i][1] = v[i][2] = -1;
+
+  for (i = 0, f = 0; *p; p++) {
+	if (*p == ',') {
+		if (++i >= N_LEDS)
+			return false;		// too many LEDs
+		f = 0;
+	} else if (*p == '/') {
+		if (++f >= 3)
+			return false;		// too many fields
+	} else if (*p == 'p' && f == 0 && v[i][0] == -1) {
+		v[i][0] = -2;
+	} else if (isDigit(*p) && v[i][f] != -2) {
+		if (v[i][f] < 0)
+			v[i][f] = 0;
+		v[i][f] = v[i][f] * 10 + (*p - '0');
+		if (v[i][f] > 255)
+			return false;		// out of range
+	} else
+		return false;
+  }
+
+  for (i = 0; i < N_LEDS; i++) {
+	unsigned char new_on = led[i].on, new_blinks = led[i].blinks;
+
+	if (v[i][0] == -2)
+		new_on = PROGRAM;
+	else if (v[i][0] == 0)
+		new_on = OFF;
+	else if (v[i][0] >= 10)
+		new_on = ON;
+	else if (v[i][0] > 0) {
+		new_on = BLINKING;
+		new_blinks = v[i][0];
+	}
+	if (v[i][1] < 0)
+		v[i][1] = led[i].intensity;
+	if (v[i][2] < 0)
+		v[i][2] = led[i].intensity_override;
+
+	// Only rebuild if something is different, so a repeat changes nothing
+	if (new_on != led[i].on || (new_on == BLINKING && new_blinks != led[i].blinks) ||
+	    v[i][1] != led[i].intensity || v[i][2] != led[i].intensity_override) {
+		led[i].on = new_on;
+		led[i].blinks = new_blinks;
+		led[i].intensity = v[i][1];
+		led[i].intensity_override = v[i][2];
+		led[i].changed = 1;
+		led_batch = true;
+		persist_mark();
+	}
+  }
+
+  ledsNode.setProperty("state").send(ledsStateText());
+  return true;
+}
+
+/*
+ * The value coming in is how long, in milliseconds, LED i takes to
+ * get to a new on or intensity.  0 changes it at once.
+ */
+bool ledFadeHandler(const HomieRange& range, const String& value) {
+  int i;
+  unsigned long numericValue;
+
+  if (!range.isRange)
+	  return false;				// If it isn't a range, then give up.
+
+  if (range.index < 0 || range.index >= N_LEDS)
+  	return false;				// If range is out of range ignore it.
+  i = range.index;
+
+  for (byte j = 0; j < value.length(); j++) {
+    if (isDigit(value.charAt(j)) == false)
+	    return false;			// If the value field isn't a number, ignore it.
+  }
+
+  numericValue = value.toInt();			// OK, what is the value?
+  if (value.length() == 0 || numericValue > 65535)
+  	return false;
+
+  if (led[i].fade_time != numericValue) {
+	led[i].fade_time = numericValue;
+	persist_mark();
+  }
+  ledNode.setProperty("fade").setRange(i).send(value);
+  return true;
+}
+
+/*
+ * The value coming in names the easing curve for LED i's fades:
+ * linear, in, out, or in-out.
+ */
+bool ledEaseHandler(const HomieRange& range, const String& value) {
+  int i, e;
+
+  if (!range.isRange)
+	  return false;				// If it isn't a range, then give up.
+
+  if (range.index < 0 || range.index >= N_LEDS)
+  	return false;				// If range is out of range ignore it.
+  i = range.index;
+
+  for (e = 0; e < N_EASE; e++)
+	  if (value == ease_name[e])
+		  break;
+  if (e >= N_EASE)
+	  return false;
+
+  if (led[i].fade_ease != e) {
+	led[i].fade_ease = e;
+	persist_mark();
+  }
+  ledNode.setProperty("ease").setRange(i).send(value);
+  return true;
+}
+
+// Bits of duty cycle the PWM pins really get: log2 of the period in cycles
+int ledPwmBits() {
+  int bits;
+
+  for (bits = 0; bits < 16 && (2UL << bits) <= led_period; bits++)
+	  ;
+  return bits;
+}
+
+/*
+ * The value coming in is the PWM frequency for the LEDs on PWM pins, in Hz.
+ * Higher frequencies flicker less on camera; lower ones leave more
+ * CPU cycles in each period, which is more steps of duty cycle.
+ */
+bool ledPwmFrequencyHandler(const HomieRange& range, const String& value) {
+  unsigned long numericValue;
+
+  for (byte j = 0; j < value.length(); j++) {
+    if (isDigit(value.charAt(j)) == false)
+	    return false;			// If the value field isn't a number, ignore it.
+  }
+
+  numericValue = value.toInt();			// OK, what is the value?
+  if (numericValue < LED_PWM_FREQ_MIN || numericValue > LED_PWM_FREQ_MAX)
+  	return false;
+
+  led_period = microsecondsToClockCycles(1000000UL) / numericValue;
+  led_refresh = true;
+
+  engineNode.setProperty("pwm-frequency").send(value);
+  engineNode.setProperty("pwm-bits").send(String(ledPwmBits()));
+  return true;
+}
+
 /*
  * This code called once to set up, but only after completely connected.
  */
 void setupHandler() {
-	phase = 2;
-	phase_time = millis();
+	// Saved orders are already showing; no light display over the top
+	if (!persist_restored) {
+		phase = 2;
+		phase_time = millis();
+		phase_load = (1UL << N_LEDS) - 1;
+	}
+	ledsNode.setProperty("state").send(ledsStateText());
+	engineNode.setProperty("pwm-frequency").send(String(microsecondsToClockCycles(1000000UL) / led_period));
+	engineNode.setProperty("pwm-bits").send(String(ledPwmBits()));
 }
 
 /*
@@ -188,31 +772,395 @@ void setupHandler() {
  * when connected to WiFi and MQTT broker
  */
 void loopHandler() {
+  uint32_t max, sum, count;
+
+  // Publish the interrupt cost and expander bus use every so often
+  if (millis() - stats_time < STATS_PERIOD)
+	  return;
+  stats_time = millis();
+  noInterrupts();
+  max = led_tick_max;
+  sum = led_tick_sum;
+  count = led_tick_count;
+  led_tick_max = 0;
+  led_tick_sum = 0;
+  led_tick_count = 0;
+  interrupts();
+
+  engineNode.setProperty("i2c-frames").send(String(pca_frames));
+  engineNode.setProperty("i2c-transactions").send(String(pca_transactions));
+  engineNode.setProperty("i2c-bytes").send(String(pca_bytes));
+  engineNode.setProperty("i2c-errors").send(String(pca_errors));
+  pca_frames = 0;
+  pca_transactions = 0;
+  pca_bytes = 0;
+  pca_errors = 0;
+
+  if (count == 0)
+	  return;
+  engineNode.setProperty("tick-max-us").send(String(max / ESP.getCpuFreqMHz()));
+  engineNode.setProperty("tick-avg-us").send(String(sum / count / ESP.getCpuFreqMHz()));
+}
+
+/*
+ * Saved orders.
+ *
+ * What each LED was last told to do is kept so that after a reset or
+ * power cycle the panel shows it straight away, instead of waiting for
+ * WiFi, MQTT and the retained set messages.  One small persist_state
+ * record holds the orders.  RTC user memory keeps a copy, rewritten on
+ * every change; Homie uses a few blocks near the start of it, so ours
+ * starts at PERSIST_RTC_OFFSET.
+ *
+ * The flash journal holds two kinds of record: persist_state, and a
+ * persist_prog for one LED's program.  The programs are too big for RTC
+ * memory and rarely change, so a program is written only when it has
+ * changed, and the orders only when they have.  Writes are batched to
+ * one per PERSIST_FLASH_BATCH.  Records are appended to one of two
+ * sectors, the newest record with the highest seq winning.  When the
+ * sector fills, the other one is erased and starts with a copy of every
+ * program that isn't empty, then the orders; an LED with no program
+ * record at all has no program.  The sector in use is the one holding
+ * the newest orders, so a copy cut short by a reset is simply done again.
+ *
+ * The two sectors are the one the EEPROM library would use and the one
+ * below it, which eagle.flash.4m1m.ld leaves free between the file
+ * system and EEPROM (see platformio.ini).
+ */
+#define	PERSIST_MAGIC		0x4c454453UL	// "LEDS"
+#define	PERSIST_PROG_MAGIC	0x4c454450UL	// "LEDP"
+#define	PERSIST_RTC_OFFSET	32		// in 4 byte blocks
+#define	PERSIST_FLASH_BATCH	60000		// at most one flash write this often, ms
+
+struct persist_led {
+	uint8_t on;
+	uint8_t blinks;
+	uint8_t intensity;
+	uint8_t intensity_override;
+	uint8_t fade_ease;
+	uint8_t pad;
+	uint16_t fade_time;
+};
+
+struct persist_state {
+	uint32_t magic;
+	uint32_t seq;			// journal sequence number
+	uint32_t crc;			// FNV-1a over chan[]
+	struct persist_led chan[N_LEDS];
+};
+
+struct persist_prog {
+	uint32_t magic;
+	uint32_t seq;			// journal sequence number
+	uint32_t crc;			// FNV-1a over led and the used part of prog
+	uint8_t led;
+	uint8_t pad[3];
+	struct led_prog prog;
+};
+
+extern "C" uint32_t _EEPROM_start;
+#define	PERSIST_SECTOR(n)	(((uint32_t)&_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE - (n))
+#define	PERSIST_SECTORS	2
+
+static_assert(sizeof (struct persist_state) % 4 == 0, "flash and RTC memory take whole words");
+static_assert(sizeof (struct persist_prog) % 4 == 0, "flash takes whole words");
+static_assert(PERSIST_RTC_OFFSET * 4 + sizeof (struct persist_state) <= 512, "RTC user memory is 512 bytes");
+static_assert(N_LEDS * sizeof (struct persist_prog) + 2 * sizeof (struct persist_state) <= SPI_FLASH_SEC_SIZE,
+    "a fresh sector must take every program and the orders, and then some");
+
+struct persist_state persist_buf;	// scratch record
+unsigned char persist_sector;		// journal sector being appended to
+unsigned short persist_off;		// where the next record goes in it
+uint32_t persist_seq;			// highest sequence number in the journal
+uint32_t persist_flash_crc;		// crc of the newest orders in the journal
+uint32_t persist_prog_crc[N_LEDS];	// crc of each LED's newest program in the journal
+bool persist_flash_pending;		// a change has not reached flash yet
+unsigned long persist_flash_time;	// millis() of the last flash write
+
+uint32_t persist_fnv(uint32_t h, const void *data, size_t n) {
+	const unsigned char *p = (const unsigned char *)data;
+
+	while (n-- > 0) {
+		h ^= *p++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+uint32_t persist_crc(const struct persist_state *ps) {
+	return persist_fnv(2166136261UL, ps->chan, sizeof ps->chan);
+}
+
+// Bytes of prog past len are left over from older programs, so they don't count
+uint32_t persist_prog_hash(unsigned char i, const struct led_prog *prog) {
+	return persist_fnv(persist_fnv(2166136261UL, &i, 1), prog, 1 + prog->len);
+}
+
+bool persist_valid(const struct persist_state *ps) {
+	int i;
+
+	if (ps->magic != PERSIST_MAGIC || ps->crc != persist_crc(ps))
+		return false;
+	for (i = 0; i < N_LEDS; i++)
+		if (ps->chan[i].on > PROGRAM || ps->chan[i].fade_ease >= N_EASE)
+			return false;
+	return true;
+}
+
+bool persist_prog_valid(const struct persist_prog *pp) {
+	return pp->magic == PERSIST_PROG_MAGIC && pp->led < N_LEDS &&
+		pp->prog.len <= LED_PROG_MAX &&
+		pp->crc == persist_prog_hash(pp->led, &pp->prog) &&
+		ledProgCheck(pp->prog.code, pp->prog.len);
+}
+
+void persist_fill(struct persist_state *ps) {
+	int i;
+
+	memset(ps, 0, sizeof *ps);
+	ps->magic = PERSIST_MAGIC;
+	for (i = 0; i < N_LEDS; i++) {
+		ps->chan[i].on = led[i].on;
+		ps->chan[i].blinks = led[i].blinks;
+		ps->chan[i].intensity = led[i].intensity;
+		ps->chan[i].intensity_override = led[i].intensity_override;
+		ps->chan[i].fade_ease = led[i].fade_ease;
+		ps->chan[i].fade_time = led[i].fade_time;
+	}
+	ps->crc = persist_crc(ps);
+}
+
+void persist_apply(const struct persist_state *ps) {
+	int i;
+
+	for (i = 0; i < N_LEDS; i++) {
+		led[i].on = ps->chan[i].on;
+		led[i].blinks = ps->chan[i].blinks;
+		led[i].intensity = ps->chan[i].intensity;
+		led[i].intensity_override = ps->chan[i].intensity_override;
+		led[i].fade_ease = ps->chan[i].fade_ease;
+		led[i].fade_time = ps->chan[i].fade_time;
+	}
+}
+
+/*
+ * Read both journal sectors.  The newest program for each LED goes
+ * straight into led[].user; the newest orders go in persist_buf.
+ * Appending carries on after the last record in the sector holding
+ * those orders.  A record we can't make sense of was cut short by a
+ * reset: if even its magic is wrong we can't tell where it ends, so
+ * that sector takes no more records.  Returns true if there were orders.
+ */
+bool persist_scan() {
+	struct persist_state best;
+	struct persist_prog pp;
+	uint32_t prog_seq[N_LEDS];
+	unsigned short end[PERSIST_SECTORS];
+	bool found = false;
+	unsigned char n, i;
+	unsigned short off;
+
+	persist_seq = 0;
+	persist_sector = 0;
+	for (i = 0; i < N_LEDS; i++) {
+		led[i].user.len = 0;
+		prog_seq[i] = 0;
+		persist_prog_crc[i] = persist_prog_hash(i, &led[i].user);
+	}
+	for (n = 0; n < PERSIST_SECTORS; n++) {
+		uint32_t addr = PERSIST_SECTOR(n) * SPI_FLASH_SEC_SIZE;
+
+		end[n] = SPI_FLASH_SEC_SIZE;
+		for (off = 0; off < SPI_FLASH_SEC_SIZE; ) {
+			ESP.flashRead(addr + off, &pp.magic, sizeof pp.magic);
+			if (pp.magic == 0xffffffffUL) {
+				end[n] = off;		// each sector is written in order, so the rest are empty
+				break;
+			}
+			if (pp.magic == PERSIST_MAGIC && off + sizeof persist_buf <= SPI_FLASH_SEC_SIZE) {
+				ESP.flashRead(addr + off, (uint32_t *)&persist_buf, sizeof persist_buf);
+				off += sizeof persist_buf;
+				if (!persist_valid(&persist_buf))
+					continue;
+				if (persist_buf.seq > persist_seq)
+					persist_seq = persist_buf.seq;
+				if (!found || persist_buf.seq > best.seq) {
+					best = persist_buf;
+					persist_sector = n;
+					found = true;
+				}
+			} else if (pp.magic == PERSIST_PROG_MAGIC && off + sizeof pp <= SPI_FLASH_SEC_SIZE) {
+				ESP.flashRead(addr + off, (uint32_t *)&pp, sizeof pp);
+				off += sizeof pp;
+				if (!persist_prog_valid(&pp))
+					continue;
+				if (pp.seq > persist_seq)
+					persist_seq = pp.seq;
+				if (pp.seq > prog_seq[pp.led]) {
+					prog_seq[pp.led] = pp.seq;
+					led[pp.led].user = pp.prog;
+					persist_prog_crc[pp.led] = pp.crc;
+				}
+			} else
+				break;
+		}
+	}
+	persist_off = end[persist_sector];
+	if (found) {
+		persist_buf = best;
+		persist_flash_crc = best.crc;
+	}
+	return found;
+}
+
+void persist_put(const void *record, size_t n) {
+	ESP.flashWrite(PERSIST_SECTOR(persist_sector) * SPI_FLASH_SEC_SIZE + persist_off,
+	    (uint32_t *)record, n);
+	persist_off += n;
+}
+
+// Append LED i's program to the journal
+void persist_prog_write(unsigned char i) {
+	struct persist_prog pp;
+
+	memset(&pp, 0xff, sizeof pp);		// unused program bytes stay erased
+	pp.magic = PERSIST_PROG_MAGIC;
+	pp.seq = ++persist_seq;
+	pp.led = i;
+	pp.prog.len = led[i].user.len;
+	memcpy(pp.prog.code, led[i].user.code, led[i].user.len);
+	pp.crc = persist_prog_hash(i, &pp.prog);
+	persist_put(&pp, sizeof pp);
+	persist_prog_crc[i] = pp.crc;
+}
+
+/*
+ * Append the orders in persist_buf, if they aren't what flash already
+ * has, and any program that has changed.  If they don't fit, move to
+ * the other sector and start it with everything.  Returns false if
+ * there was nothing to write.
+ */
+bool persist_flash_write() {
+	uint32_t changed = 0;
+	size_t need = 0;
+	unsigned char i;
+
+	for (i = 0; i < N_LEDS; i++)
+		if (persist_prog_hash(i, &led[i].user) != persist_prog_crc[i]) {
+			changed |= 1UL << i;
+			need += sizeof (struct persist_prog);
+		}
+	if (persist_buf.crc != persist_flash_crc)
+		need += sizeof persist_buf;
+	if (need == 0)
+		return false;
+
+	if (persist_off + need > SPI_FLASH_SEC_SIZE) {
+		persist_sector = (persist_sector + 1) % PERSIST_SECTORS;
+		ESP.flashEraseSector(PERSIST_SECTOR(persist_sector));
+		persist_off = 0;
+		for (i = 0; i < N_LEDS; i++)
+			if (led[i].user.len > 0)
+				persist_prog_write(i);
+			else
+				persist_prog_crc[i] = persist_prog_hash(i, &led[i].user);
+	} else {
+		for (i = 0; i < N_LEDS; i++)
+			if (changed & 1UL << i)
+				persist_prog_write(i);
+		if (persist_buf.crc == persist_flash_crc)
+			return true;
+	}
+	persist_buf.seq = ++persist_seq;
+	persist_put(&persist_buf, sizeof persist_buf);
+	persist_flash_crc = persist_buf.crc;
+	return true;
+}
+
+/*
+ * Called from setup() before the LEDs start.  The programs come from the
+ * journal.  The orders come from RTC memory if it is valid, since it
+ * survives only a reset and is always current; otherwise from the
+ * journal.  Returns true if any orders were restored.
+ */
+bool persist_restore() {
+	struct persist_state rtc;
+	bool from_rtc, found;
+
+	ESP.rtcUserMemoryRead(PERSIST_RTC_OFFSET, (uint32_t *)&rtc, sizeof rtc);
+	from_rtc = persist_valid(&rtc);
+	found = persist_scan();
+	if (from_rtc)
+		persist_apply(&rtc);
+	else if (found)
+		persist_apply(&persist_buf);
+	return from_rtc || found;
+}
+
+/*
+ * Called once per loop() pass.  RTC memory is cheap, so it is rewritten
+ * on every change.  Flash changes are batched to one write per
+ * PERSIST_FLASH_BATCH, and skipped if we have come back to what flash
+ * already holds.
+ */
+void persist_flush(unsigned long t) {
+	if (persist_dirty) {
+		persist_dirty = false;
+		persist_fill(&persist_buf);
+		ESP.rtcUserMemoryWrite(PERSIST_RTC_OFFSET, (uint32_t *)&persist_buf, sizeof persist_buf);
+		persist_flash_pending = true;
+	}
+
+	if (persist_flash_pending && t - persist_flash_time >= PERSIST_FLASH_BATCH) {
+		persist_flash_pending = false;
+		persist_fill(&persist_buf);
+		if (persist_flash_write())
+			persist_flash_time = t;
+	}
 }
 
 void setup() {
   int i;
-  unsigned long now;
 
   Serial.begin(115200);
   Serial << endl << endl;
 
-  now = millis();
+  led_period = microsecondsToClockCycles(1000000UL) / LED_PWM_FREQ;
+  led_refresh = false;
+  led_wave_dirty = 0;
+  leds::init();
+  pcaBegin();
   for (i = 0; i < N_LEDS; i++) {
-	pinMode(ledpin[i], OUTPUT);
-	digitalWrite(ledpin[i], LED_OFF_VALUE);
-	on[i] = OFF;
-	lastMillis[i] = now;
-	intensity[i] = 255;
-	intensity_override[i] = 0;
-	changed[i] = 0;
-	state[i] = 0;
+	led[i].on = OFF;
+	led[i].intensity = 255;
+	led[i].intensity_override = 0;
+	led[i].fade_time = DEFAULT_FADE;
+	led[i].fade_ease = EASE_IN_OUT;
+	led[i].changed = 0;
+	led[i].active = 0;
+	led[i].pending = false;
+	led[i].progs[0].len = 0;
+	led[i].user.len = 0;
+	memset(&led[i].vm, 0, sizeof led[i].vm);
+	led[i].out = -1;
+	led[i].sd_err = 0;
+	led[i].wave_on = false;
   }
+  led_hold = false;
+  led_batch = false;
+  persist_dirty = false;
 
-  // initiate the startup sequence
-  phase = 1;
-  for (i = 0; i < N_LEDS; i++) 
-  	ledOn(i);
+  // Show the saved orders at once, or failing that, start the light
+  // display: everything on until we connect.
+  persist_restored = persist_restore();
+  phase = persist_restored? 0: 1;
+  for (i = 0; i < N_LEDS; i++)
+	ledBuild(i);
+  stats_time = millis();
+  led_tick_max = 0;
+  led_tick_sum = 0;
+  led_tick_count = 0;
+  setTimer1Callback(ledTimer);
 
   Homie_setFirmware(FIRMWARE_NAME, FIRMWARE_VERSION);
 
@@ -225,6 +1173,46 @@ void setup() {
   ledNode.advertise("intensity-override").settable(ledIntensityOverrideHandler)
   			.setName("LED Intensity Override")
 			.setDatatype("int");
+  ledNode.advertise("fade").settable(ledFadeHandler)
+  			.setName("LED Fade Time")
+			.setDatatype("integer")
+			.setUnit("ms");
+  ledNode.advertise("ease").settable(ledEaseHandler)
+  			.setName("LED Fade Curve")
+			.setDatatype("enum")
+			.setFormat("linear,in,out,in-out");
+  ledsNode.advertise("state").settable(ledsStateHandler)
+  			.setName("All LEDs")
+			.setDatatype("string");
+  ledNode.advertise("program").settable(ledProgramHandler)
+  			.setName("LED Program")
+			.setDatatype("string");
+
+  engineNode.advertise("pwm-frequency").settable(ledPwmFrequencyHandler)
+  			.setName("LED PWM Frequency")
+			.setDatatype("integer")
+			.setUnit("Hz");
+  engineNode.advertise("pwm-bits")
+  			.setName("LED PWM Resolution")
+			.setDatatype("integer");
+  engineNode.advertise("i2c-frames")
+  			.setName("Expander Frames")
+			.setDatatype("integer");
+  engineNode.advertise("i2c-transactions")
+  			.setName("Expander I2C Transactions")
+			.setDatatype("integer");
+  engineNode.advertise("i2c-bytes")
+  			.setName("Expander I2C Bytes")
+			.setDatatype("integer");
+  engineNode.advertise("i2c-errors")
+  			.setName("Expander I2C Errors")
+			.setDatatype("integer");
+  engineNode.advertise("tick-max-us")
+  			.setName("Longest LED Interrupt")
+			.setDatatype("integer");
+  engineNode.advertise("tick-avg-us")
+  			.setName("Average LED Interrupt")
+			.setDatatype("integer");
 
   Homie.setSetupFunction(setupHandler).setLoopFunction(loopHandler);
 
@@ -232,45 +1220,133 @@ void setup() {
 }
 
 /*
- * Turn on the LED at the right intensity.  If the led is
- * already on and the intensity has not changed, do not make
- * another call to analogWrite().
+ * Run one LED's program for one tick, and return its level.
+ * Pick up a new program first if there is one.
+ */
+static inline __attribute__((always_inline)) unsigned short ledVm(struct led_channel *ch) {
+	if (ch->pending && !led_hold) {
+		ch->active ^= 1;
+		ch->pending = false;
+		ledVmStart(&ch->vm);
+	}
+	return ledVmTick(&ch->vm, &ch->progs[ch->active]);
+}
 
- * Note that since driving the pin low turns on the LED we
- * need to use 255-i as intensity i.
+// The GPIO LEDs get the interpreter inlined, straight into their pin writes
+template <class PIN, class... REST>
+inline __attribute__((always_inline)) void led_bank<PIN, REST...>::tick(struct led_channel *ch) {
+	PIN::write(ch, ledVm(ch));
+	led_bank<REST...>::tick(ch + 1);
+}
 
- * If the LED is not on a PWM capable pin, just set it on.
+// The expander LEDs all share one copy
+unsigned short IRAM_ATTR ledVmStep(struct led_channel *ch) {
+	return ledVm(ch);
+}
+
+/*
+ * Timer interrupt, every LED_TICK microseconds.
+ * Picks up new programs and runs each LED's for one tick.
  */
-void ledOn(int i) {
-	unsigned char c_intensity;
+uint32_t IRAM_ATTR ledTimer() {
+	uint32_t start = ESP.getCycleCount();
+	uint32_t cycles;
+	int i;
 
-	c_intensity = intensity[i];
-	if (c_intensity < intensity_override[i])
-		c_intensity = intensity_override[i];
-	if (c_intensity < 1)
-		c_intensity = 1;
+	// New PWM period: every pin needs writing again
+	if (led_refresh) {
+		led_refresh = false;
+		for (i = 0; i < N_LEDS; i++)
+			led[i].out = -1;
+	}
+	leds::tick(led);
+	for (i = 0; i < PCA9685_LEDS; i++)
+		pcaWrite(i, ledVmStep(&led[N_GPIO_LEDS + i]));
 
-	if (c_intensity == 255 || !pwm_capable[i]) 
-		digitalWrite(ledpin[i], LED_ON_VALUE);
-	else if (state[i] == 0 || changed[i])
-		analogWrite(ledpin[i], 4*(255-c_intensity));
+	cycles = ESP.getCycleCount() - start;
+	if (cycles > led_tick_max)
+		led_tick_max = cycles;
+	led_tick_sum += cycles;
+	led_tick_count++;
+	return LED_TICK;
+}
 
-	state[i] = 1;
+// The buffer loop() may fill for LED i, or NULL if the last one is not picked up yet
+struct led_prog *led_next(int i) {
+	if (led[i].pending)
+		return NULL;
+	return &led[i].progs[led[i].active ^ 1];
 }
 
-void ledOff(int i) {
-	digitalWrite(ledpin[i], LED_OFF_VALUE);
-	state[i] = 0;
+// Hand a buffer filled in through led_next() to the interrupt
+void led_load(int i) {
+	__sync_synchronize();
+	led[i].pending = true;
 }
 
-const int fade_rate = 8;		// 2.048 seconds
+/*
+ * Build the program for what LED i has been told to do.
+ * Returns false if the interrupt has not taken the last one yet.
+ */
+bool ledBuild(int i) {
+	struct led_prog *t;
+	unsigned char *c;
+	unsigned char c_intensity;
+
+	if ((t = led_next(i)) == NULL)
+		return false;
+	c = t->code;
+
+	c_intensity = led[i].intensity;
+	if (c_intensity < led[i].intensity_override)
+		c_intensity = led[i].intensity_override;
+	if (c_intensity < 1)
+		c_intensity = 1;
+
+	// Startup: all on until connected, then fade LED 1 out, the others off.
+	if (phase == 1) {
+		*c++ = OP_SET; *c++ = 255;
+	} else if (phase == 2) {
+		c = ledTransition(c, 0, boot_fade[i], EASE_LINEAR);
+	} else switch (led[i].on) {
+	case ON:
+		c = ledTransition(c, c_intensity, led[i].fade_time, led[i].fade_ease);
+		break;
+	case BLINKING:
+		c = ledBlink(c, c_intensity, led[i].blinks, BLINK_ON_TIME, BLINK_OFF_TIME, PAUSE_TIME);
+		break;
+	case PROGRAM:
+		memcpy(c, led[i].user.code, led[i].user.len);
+		c += led[i].user.len;
+		break;
+	default:
+		c = ledTransition(c, 0, led[i].fade_time, led[i].fade_ease);
+		break;
+	}
+	t->len = c - t->code;
+	led_load(i);
+	return true;
+}
 
 void loop() {
-  unsigned long now;
+  uint32_t dirty;
   int i;
 
   Homie.loop();
-  now = millis();
+
+  // New duty cycles for the PWM pins, from the interrupt
+  noInterrupts();
+  dirty = led_wave_dirty;
+  led_wave_dirty = 0;
+  interrupts();
+  if (dirty)
+	  leds::wave(led, dirty);
+
+  if (millis() - pca_time >= PCA9685_FRAME) {
+	  pca_time = millis();
+	  pcaFlush();
+  }
+  persist_flush(millis());
 
   // put on a little light display before we start real work.
   switch (phase) {
@@ -279,66 +1355,46 @@ void loop() {
 	case 1:
 		return;
 	case 2:
-		if (now - phase_time < fade_rate * 256) {
-			ledOff(2);
-			ledOff(0);
-			i = 256 - (now - phase_time)/fade_rate;
-			if (intensity[1] != i)
-				changed[1] = 1;
-			intensity[1] = i;
-			ledOn(1);
-			changed[1] = 0;
+		if (millis() - phase_time < FADE_TIME) {
+			for (i = 0; i < N_LEDS; i++)
+				if ((phase_load & (1UL << i)) && ledBuild(i))
+					phase_load &= ~(1UL << i);
 			return;
 		}
 		phase = 0;
+		for (i = 0; i < N_LEDS; i++)
+			led[i].changed = 1;
+		led_batch = true;
 		break;
   }
 
-  for (i = 0; i < N_LEDS; i++) {
-	switch (on[i]) {
-	case ON:
-		ledOn(i);
-		break;
-	case OFF:
-		ledOff(i);
-		break;
-	case BLINKING:
-		if (bcnt[i] & 1) 
-			ledOn(i);
-		else
-			ledOff(i);
-		break;
-	case PAUSING:
-		ledOff(i);
-		break;
-	default:
-		if (now & 0x400) 
-			ledOn(i);
-		else
-			ledOff(i);
-		break;
-	}
-	changed[i] = 0;
-	if (timeNext[i] > 0 && lastMillis[i] != now) {
-		timeNext[i]--;
-		lastMillis[i] = now;
-	}
-	if (timeNext[i] == 0) switch (on[i]) {
-		case BLINKING:
-			bcnt[i]--;
-			if (bcnt[i] == 0) {
-				on[i] = PAUSING;
-				timeNext[i] = PAUSE_TIME;
-			} else if (bcnt[i] & 1)
-				timeNext[i] = BLINK_ON_TIME;
-			else
-				timeNext[i] = BLINK_OFF_TIME;
-			break;
-		case PAUSING:
-			bcnt[i] = blinks[i] * 2 - 1;
-			on[i] = BLINKING;
-			timeNext[i] = BLINK_ON_TIME;
-			break;
-	}
+  /*
+   * A batch goes out all at once.  Wait until the interrupt has taken
+   * every LED's last program, then hold it off while the new ones are
+   * built, so it picks them all up on the same tick.  LEDs the batch
+   * didn't change carry on where they are.
+   */
+  if (led_batch) {
+	for (i = 0; i < N_LEDS; i++)
+		if (led[i].pending)
+			return;
+	led_hold = true;
+	for (i = 0; i < N_LEDS; i++)
+		if (led[i].changed) {
+			led[i].changed = 0;
+			ledBuild(i);
+		}
+	__sync_synchronize();
+	led_hold = false;
+	led_batch = false;
+	return;
   }
+
+  // Only LEDs whose orders changed need any work
+  for (i = 0; i < N_LEDS; i++)
+	if (led[i].changed) {
+		led[i].changed = 0;
+		if (!ledBuild(i))
+			led[i].changed = 1;		// try again next pass
+	}
 }
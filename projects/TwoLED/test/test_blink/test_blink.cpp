@@ -0,0 +1,103 @@
+//
+// Native tests for blink timing: pio test -e native
+//
+// Blinks used to be timed by counting loop() passes, and a slow pass
+// through Homie.loop() stretched the pattern.  Now the timer interrupt
+// runs each LED's program once a millisecond, so a blink pattern is
+// exactly right if every HOLD lasts its count of ticks and the program
+// comes back round without losing or gaining one.  Run an hour of ticks
+// and check every edge lands on the millisecond it should.
+//
+#include <unity.h>
+#include <stdio.h>
+#include "led_vm.h"
+
+#define	ON_MS		100		// as in main.cpp
+#define	OFF_MS		700
+#define	PAUSE_MS	2000
+#define	HOUR		3600000UL
+
+// When the k-th edge of an n blink pattern falls, in ms from the start
+static unsigned long expected_edge(unsigned char n, unsigned long k)
+{
+	unsigned long cycle = n * ON_MS + (n - 1) * OFF_MS + PAUSE_MS;
+	unsigned long t = k / (2 * n) * cycle;
+	unsigned long e = k % (2 * n);		// on, off, on, off ... on, pause
+
+	t += e / 2 * (ON_MS + OFF_MS);
+	if (e & 1)
+		t += ON_MS;
+	return t;
+}
+
+static void blink_hour(unsigned char n)
+{
+	struct led_prog prog;
+	struct led_vm vm;
+	unsigned long t, k = 0;
+	bool lit = false;
+	char msg[80];
+
+	prog.len = ledBlink(prog.code, 255, n, ON_MS, OFF_MS, PAUSE_MS) - prog.code;
+	TEST_ASSERT_TRUE(prog.len <= LED_PROG_MAX);
+	vm.level = 0;
+	ledVmStart(&vm);
+	for (t = 0; t < HOUR; t++) {
+		bool now = ledVmTick(&vm, &prog) != 0;
+
+		if (now == lit)
+			continue;
+		snprintf(msg, sizeof msg, "%d blinks, edge %lu", n, k);
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_edge(n, k), t, msg);
+		TEST_ASSERT_EQUAL_MESSAGE(k % 2 == 0, now, msg);
+		lit = now;
+		k++;
+	}
+	// and the pattern did not stop early
+	TEST_ASSERT_TRUE(expected_edge(n, k) >= HOUR);
+	TEST_ASSERT_TRUE(expected_edge(n, k - 1) < HOUR);
+}
+
+void test_one_blink(void)
+{
+	blink_hour(1);
+}
+
+void test_three_blinks(void)
+{
+	blink_hour(3);
+}
+
+void test_nine_blinks(void)
+{
+	blink_hour(9);
+}
+
+// Each on time is exactly ON_MS ticks at full intensity
+void test_on_time(void)
+{
+	struct led_prog prog;
+	struct led_vm vm;
+	unsigned long t, lit = 0;
+
+	prog.len = ledBlink(prog.code, 255, 2, ON_MS, OFF_MS, PAUSE_MS) - prog.code;
+	vm.level = 0;
+	ledVmStart(&vm);
+	for (t = 0; t < 2 * ON_MS + OFF_MS + PAUSE_MS; t++)
+		if (ledVmTick(&vm, &prog) == 255 * 257)
+			lit++;
+	TEST_ASSERT_EQUAL_UINT32(2 * ON_MS, lit);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+int main(void)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_one_blink);
+	RUN_TEST(test_three_blinks);
+	RUN_TEST(test_nine_blinks);
+	RUN_TEST(test_on_time);
+	return UNITY_END();
+}
@@ -0,0 +1,255 @@
+//
+// Native tests for the PCA9685 framing: pio test -e native
+//
+// The expander code in pca9685.h runs against a fake Wire that keeps
+// every transaction it is given.  The checks are on what would go down
+// the bus: which register each run starts at, that neighbouring dirty
+// channels share one transaction, the full on and full off bits, and
+// that a run the chip refuses is sent again on the next frame.
+//
+#include <unity.h>
+#include <stdint.h>
+#include <string.h>
+
+#define	LOW		0
+#define	BUFFER_LENGTH	128		// as in the ESP8266 core's Wire
+
+#define	MAX_TX		64
+#define	MAX_BYTES	BUFFER_LENGTH
+
+// One transaction: address, then the bytes after it
+struct tx {
+	uint8_t addr;
+	int len;
+	uint8_t data[MAX_BYTES];
+};
+
+struct FakeWire {
+	struct tx tx[MAX_TX];
+	int n_tx;
+	bool open;
+	int fail;			// refuse this many more transactions
+
+	void begin() {}
+	void setClock(uint32_t) {}
+	void beginTransmission(uint8_t addr) {
+		TEST_ASSERT_FALSE_MESSAGE(open, "transaction inside a transaction");
+		TEST_ASSERT_LESS_THAN(MAX_TX, n_tx);
+		open = true;
+		tx[n_tx].addr = addr;
+		tx[n_tx].len = 0;
+	}
+	size_t write(uint8_t b) {
+		TEST_ASSERT_TRUE_MESSAGE(open, "write outside a transaction");
+		TEST_ASSERT_LESS_THAN(BUFFER_LENGTH, tx[n_tx].len);
+		tx[n_tx].data[tx[n_tx].len++] = b;
+		return 1;
+	}
+	uint8_t endTransmission() {
+		TEST_ASSERT_TRUE(open);
+		open = false;
+		n_tx++;
+		if (fail > 0) {
+			fail--;
+			return 2;		// address not acknowledged
+		}
+		return 0;
+	}
+};
+
+static FakeWire Wire;
+static int irq_off;
+
+static void noInterrupts() { irq_off++; }
+static void interrupts() { irq_off--; }
+static void delayMicroseconds(unsigned int) {}
+
+#define	PCA9685_LEDS		16
+#define	PCA9685_ON_VALUE	LOW
+#include "pca9685.h"
+
+// Level for intensity c, as the interpreter hands it over
+#define	LEVEL(c)	((c) * 257)
+
+// The four bytes pcaFlush() should send for a pca_duty[] of v
+static void expect_channel(const uint8_t *p, unsigned short v)
+{
+	TEST_ASSERT_EQUAL_HEX8(0, p[0]);
+	TEST_ASSERT_EQUAL_HEX8(v == 4096? PCA9685_FULL: 0, p[1]);
+	TEST_ASSERT_EQUAL_HEX8(v & 0xff, p[2]);
+	TEST_ASSERT_EQUAL_HEX8(v == 0? PCA9685_FULL: (v >> 8) & 0x0f, p[3]);
+}
+
+// Check transaction t writes channels a to b-1 with their pca_duty[]
+static void expect_run(int t, int a, int b)
+{
+	const struct tx *x = &Wire.tx[t];
+	int n;
+
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_ADDR, x->addr);
+	TEST_ASSERT_EQUAL(1 + 4 * (b - a), x->len);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_LED0 + 4 * a, x->data[0]);
+	for (n = a; n < b; n++)
+		expect_channel(&x->data[1 + 4 * (n - a)], pca_duty[n]);
+}
+
+static void frame()
+{
+	Wire.n_tx = 0;
+	pcaFlush();
+	TEST_ASSERT_EQUAL(0, irq_off);
+}
+
+void setUp(void)
+{
+	memset(&Wire, 0, sizeof Wire);
+	pca_frames = pca_transactions = pca_bytes = pca_errors = 0;
+	pcaBegin();
+	frame();				// the first frame writes them all
+}
+
+void tearDown(void)
+{
+}
+
+void test_begin(void)
+{
+	memset(&Wire, 0, sizeof Wire);
+	pcaBegin();
+	TEST_ASSERT_TRUE(pca_present);
+	TEST_ASSERT_EQUAL(4, Wire.n_tx);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_MODE1, Wire.tx[0].data[0]);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_SLEEP, Wire.tx[0].data[1]);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_PRE_SCALE, Wire.tx[1].data[0]);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_MODE2, Wire.tx[2].data[0]);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_OUTDRV | PCA9685_INVRT, Wire.tx[2].data[1]);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_MODE1, Wire.tx[3].data[0]);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_AI | PCA9685_ALLCALL, Wire.tx[3].data[1]);
+	TEST_ASSERT_EQUAL_HEX32((1UL << PCA9685_LEDS) - 1, pca_dirty);
+
+	// Nobody home: nothing more goes on the bus
+	memset(&Wire, 0, sizeof Wire);
+	Wire.fail = 1;
+	pcaBegin();
+	TEST_ASSERT_FALSE(pca_present);
+	TEST_ASSERT_EQUAL(1, Wire.n_tx);
+	pcaWrite(0, LEVEL(255));
+	frame();
+	TEST_ASSERT_EQUAL(0, Wire.n_tx);
+}
+
+void test_first_frame(void)
+{
+	memset(&Wire, 0, sizeof Wire);
+	pca_frames = pca_transactions = pca_bytes = pca_errors = 0;
+	pcaBegin();
+	frame();
+	TEST_ASSERT_EQUAL(1, Wire.n_tx);
+	expect_run(0, 0, PCA9685_LEDS);
+	TEST_ASSERT_EQUAL(1, pca_frames);
+	TEST_ASSERT_EQUAL(1, pca_transactions);
+	TEST_ASSERT_EQUAL(2 + 4 * PCA9685_LEDS, pca_bytes);
+	TEST_ASSERT_EQUAL_HEX32(0, pca_dirty);
+}
+
+void test_nothing_changed(void)
+{
+	pcaWrite(3, 0);				// already off
+	frame();
+	TEST_ASSERT_EQUAL(0, Wire.n_tx);
+	TEST_ASSERT_EQUAL(1, pca_frames);	// the first one only
+}
+
+void test_runs(void)
+{
+	pcaWrite(1, LEVEL(10));
+	pcaWrite(2, LEVEL(20));
+	pcaWrite(3, LEVEL(30));
+	pcaWrite(7, LEVEL(70));
+	pcaWrite(14, LEVEL(140));
+	pcaWrite(15, LEVEL(150));
+	frame();
+	TEST_ASSERT_EQUAL(3, Wire.n_tx);
+	expect_run(0, 1, 4);
+	expect_run(1, 7, 8);
+	expect_run(2, 14, 16);
+	TEST_ASSERT_EQUAL(4, pca_transactions);
+	TEST_ASSERT_EQUAL(2 + 4 * PCA9685_LEDS + (2 + 12) + (2 + 4) + (2 + 8), pca_bytes);
+}
+
+void test_full_on_and_off(void)
+{
+	unsigned short v;
+
+	pcaWrite(0, LEVEL(255));
+	pcaWrite(1, LEVEL(1));
+	pcaWrite(2, LEVEL(128));
+	frame();
+	TEST_ASSERT_EQUAL(4096, pca_duty[0]);
+	TEST_ASSERT_EQUAL(1, pca_duty[1]);	// dim, but never rounded to off
+	v = gamma_table.duty[128] >> 4;
+	TEST_ASSERT_EQUAL(v, pca_duty[2]);
+	TEST_ASSERT_EQUAL(1, Wire.n_tx);
+	expect_run(0, 0, 3);
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_FULL, Wire.tx[0].data[2]);	// 0: ON_H full
+	TEST_ASSERT_EQUAL_HEX8(0, Wire.tx[0].data[4]);		// 0: OFF_H
+	TEST_ASSERT_EQUAL_HEX8(0, Wire.tx[0].data[6]);		// 1: ON_H
+	TEST_ASSERT_EQUAL_HEX8(1, Wire.tx[0].data[7]);		// 1: OFF_L
+
+	pcaWrite(0, 0);
+	frame();
+	TEST_ASSERT_EQUAL(1, Wire.n_tx);
+	expect_run(0, 0, 1);
+	TEST_ASSERT_EQUAL_HEX8(0, Wire.tx[0].data[2]);		// ON_H
+	TEST_ASSERT_EQUAL_HEX8(PCA9685_FULL, Wire.tx[0].data[4]);	// OFF_H full
+}
+
+void test_every_duty(void)
+{
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		pcaWrite(5, LEVEL(c));
+		frame();
+		if (Wire.n_tx == 0)
+			continue;	// same 12 bit duty as the last one
+		TEST_ASSERT_EQUAL(1, Wire.n_tx);
+		expect_run(0, 5, 6);
+	}
+}
+
+void test_retry(void)
+{
+	pcaWrite(2, LEVEL(20));
+	pcaWrite(3, LEVEL(30));
+	pcaWrite(9, LEVEL(90));
+	Wire.fail = 1;				// the 2 - 3 run is refused
+	frame();
+	TEST_ASSERT_EQUAL(2, Wire.n_tx);
+	TEST_ASSERT_EQUAL(1, pca_errors);
+	TEST_ASSERT_EQUAL_HEX32(3UL << 2, pca_dirty);
+
+	// Channel 3 changes again meanwhile; the retry sends the new value
+	pcaWrite(3, LEVEL(31));
+	frame();
+	TEST_ASSERT_EQUAL(1, Wire.n_tx);
+	expect_run(0, 2, 4);
+	TEST_ASSERT_EQUAL(1, pca_errors);
+	TEST_ASSERT_EQUAL_HEX32(0, pca_dirty);
+
+	frame();
+	TEST_ASSERT_EQUAL(0, Wire.n_tx);
+}
+
+int main(void)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_begin);
+	RUN_TEST(test_first_frame);
+	RUN_TEST(test_nothing_changed);
+	RUN_TEST(test_runs);
+	RUN_TEST(test_full_on_and_off);
+	RUN_TEST(test_every_duty);
+	RUN_TEST(test_retry);
+	return UNITY_END();
+}
@@ -0,0 +1,8 @@
+#!/bin/sh
+# Same display as intensity.sh, one message per change for all the LEDs
+while true; do
+	for i in 8 128 255 ; do
+		mosquitto_pub -t devices/led-0002/leds/state/set -m ",10/$i,10/$i"
+		sleep 1
+	done
+done
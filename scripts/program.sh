@@ -0,0 +1,6 @@
+#!/bin/sh
+# Same display as intensity.sh, as one program per LED:
+# SET 8, HOLD 1000, SET 128, HOLD 1000, SET 255, HOLD 1000, JUMP 0
+for i in 1 2 ; do
+	mosquitto_pub -r -t devices/led-0002/led_${i}/program/set -m '0108 0303E8 0180 0303E8 01FF 0303E8 0500'
+done
@@ -0,0 +1,2 @@
+#!/bin/sh
+mosquitto_pub -r -t 'devices/plug-0002/outlet/schedule/set' -m '06:30=on 08:00=off 17:30=on 23:00=off 6/09:00=on'